@@ -0,0 +1,260 @@
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+
+#include <mocker/affinity.h>
+#include <mocker/log.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    // "0-3,8,10-11" -> 0 1 2 3 8 10 11
+    static std::vector<int> parse_cpu_list(const std::string &str) {
+        std::vector<int> res;
+        std::stringstream ss(str);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (item.empty() || item == "\n") {
+                continue;
+            }
+            size_t dash = item.find('-');
+            int begin = atoi(item.c_str());
+            int end = dash == std::string::npos ? begin : atoi(item.c_str() + dash + 1);
+            for (int i = begin; i <= end; ++i) {
+                res.push_back(i);
+            }
+        }
+        return res;
+    }
+
+    static std::string read_line(const std::string &path) {
+        std::ifstream ifs(path);
+        std::string line;
+        std::getline(ifs, line);
+        return line;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    /// CpuTopology
+    ////////////////////////////////////////////////////////////////////
+    CpuTopology::CpuTopology() {
+        const std::string sys = "/sys/devices/system/";
+        std::vector<int> online = parse_cpu_list(read_line(sys + "cpu/online"));
+        if (online.empty()) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            for (long i = 0; i < n; ++i) {
+                online.push_back((int) i);
+            }
+        }
+
+        for (int id : online) {
+            std::string topo = sys + "cpu/cpu" + std::to_string(id) + "/topology/";
+            std::string package = read_line(topo + "physical_package_id");
+            std::string core = read_line(topo + "core_id");
+            Cpu cpu;
+            cpu.id = id;
+            cpu.node = 0;
+            cpu.package = package.empty() ? 0 : atoi(package.c_str());
+            cpu.core = core.empty() ? id : atoi(core.c_str());
+            m_cpus.push_back(cpu);
+        }
+
+        std::vector<int> nodes = parse_cpu_list(read_line(sys + "node/online"));
+        for (int node : nodes) {
+            std::vector<int> cpus = parse_cpu_list(read_line(sys + "node/node" + std::to_string(node) + "/cpulist"));
+            for (int id : cpus) {
+                for (auto &cpu : m_cpus) {
+                    if (cpu.id == id) {
+                        cpu.node = node;
+                    }
+                }
+            }
+            m_nodeCount = std::max(m_nodeCount, node + 1);
+        }
+    }
+
+    const CpuTopology &CpuTopology::Get() {
+        static CpuTopology s_topology;
+        return s_topology;
+    }
+
+    int CpuTopology::getNodeOfCpu(int cpu) const {
+        for (auto &i : m_cpus) {
+            if (i.id == cpu) {
+                return i.node;
+            }
+        }
+        return -1;
+    }
+
+    std::vector<int> CpuTopology::getNodeCpus(int node) const {
+        std::vector<int> res;
+        for (auto &i : m_cpus) {
+            if (i.node == node) {
+                res.push_back(i.id);
+            }
+        }
+        return res;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// AffinityPolicy
+    ////////////////////////////////////////////////////////////////////
+    std::vector<int> AffinityPolicy::cpusFor(size_t index) const {
+        const CpuTopology &topo = CpuTopology::Get();
+        std::vector<CpuTopology::Cpu> cpus = topo.getCpus();
+        if (cpus.empty()) {
+            return {};
+        }
+
+        switch (type) {
+            case LIST:
+                if (this->cpus.empty()) {
+                    return {};
+                }
+                return {this->cpus[index % this->cpus.size()]};
+            case COMPACT:
+                // hyper-threads of a core are next to each other
+                std::sort(cpus.begin(), cpus.end(), [](const CpuTopology::Cpu &a, const CpuTopology::Cpu &b) {
+                    if (a.node != b.node) return a.node < b.node;
+                    if (a.package != b.package) return a.package < b.package;
+                    if (a.core != b.core) return a.core < b.core;
+                    return a.id < b.id;
+                });
+                return {cpus[index % cpus.size()].id};
+            case SCATTER: {
+                // round robin over nodes, first hyper-thread of every core first
+                int nodes = topo.getNodeCount();
+                std::vector<std::vector<int>> per_node(nodes);
+                for (int n = 0; n < nodes; ++n) {
+                    std::vector<CpuTopology::Cpu> node_cpus;
+                    for (auto &c : cpus) {
+                        if (c.node == n) {
+                            node_cpus.push_back(c);
+                        }
+                    }
+                    std::sort(node_cpus.begin(), node_cpus.end(),
+                              [](const CpuTopology::Cpu &a, const CpuTopology::Cpu &b) {
+                                  return a.id < b.id;
+                              });
+                    std::vector<std::pair<int, int>> order;     // (sibling rank, position)
+                    for (size_t i = 0; i < node_cpus.size(); ++i) {
+                        int rank = 0;
+                        for (size_t j = 0; j < i; ++j) {
+                            if (node_cpus[j].package == node_cpus[i].package
+                                && node_cpus[j].core == node_cpus[i].core) {
+                                ++rank;
+                            }
+                        }
+                        order.emplace_back(rank, (int) i);
+                    }
+                    std::sort(order.begin(), order.end());
+                    for (auto &o : order) {
+                        per_node[n].push_back(node_cpus[o.second].id);
+                    }
+                }
+                std::vector<int> spread;
+                for (size_t round = 0; spread.size() < cpus.size(); ++round) {
+                    for (int n = 0; n < nodes; ++n) {
+                        if (round < per_node[n].size()) {
+                            spread.push_back(per_node[n][round]);
+                        }
+                    }
+                }
+                return {spread[index % spread.size()]};
+            }
+            case NUMA: {
+                int n = node >= 0 ? node : (int) (index % topo.getNodeCount());
+                return topo.getNodeCpus(n);
+            }
+            case NONE:
+            default:
+                return {};
+        }
+    }
+
+    AffinityPolicy::Type AffinityPolicy::FromString(const std::string &str) {
+#define XX(type, v) \
+        if (str == #v) { \
+            return type; \
+        }
+        XX(NONE, none);
+        XX(LIST, list);
+        XX(COMPACT, compact);
+        XX(SCATTER, scatter);
+        XX(NUMA, numa);
+#undef XX
+        MOCKER_LOG_ERROR(g_logger) << "unknown affinity policy " << str;
+        return NONE;
+    }
+
+    const char *AffinityPolicy::ToString(Type type) {
+        switch (type) {
+#define XX(name, v) \
+            case name: \
+                return #v;
+            XX(NONE, none);
+            XX(LIST, list);
+            XX(COMPACT, compact);
+            XX(SCATTER, scatter);
+            XX(NUMA, numa);
+#undef XX
+            default:
+                return "none";
+        }
+    }
+
+
+    bool SetThreadAffinity(pthread_t thread, const std::vector<int> &cpus) {
+        if (cpus.empty()) {
+            return true;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        int rt = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (rt) {
+            MOCKER_LOG_ERROR(g_logger) << "pthread_setaffinity_np fail, rt=" << rt;
+            return false;
+        }
+        return true;
+    }
+
+    void *NumaAlloc(size_t size, int node) {
+        if (node < 0) {
+            return malloc(size);
+        }
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (ptr == MAP_FAILED) {
+            MOCKER_LOG_ERROR(g_logger) << "mmap " << size << " bytes fail, errno=" << errno;
+            return nullptr;
+        }
+        // a preference only, the pages still come from elsewhere when the node is full
+        if (node < (int) (sizeof(unsigned long) * 8)) {
+            unsigned long mask = 1ul << node;
+            if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0)) {
+                MOCKER_LOG_DEBUG(g_logger) << "mbind to node " << node << " fail, errno=" << errno;
+            }
+        }
+        return ptr;
+    }
+
+    void NumaFree(void *ptr, size_t size, int node) {
+        if (node < 0) {
+            free(ptr);
+        } else if (ptr) {
+            munmap(ptr, size);
+        }
+    }
+
+}
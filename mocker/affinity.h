@@ -0,0 +1,135 @@
+#ifndef MOCKER_AFFINITY_H
+#define MOCKER_AFFINITY_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include <mocker/config.h>
+
+namespace mocker {
+
+    /**
+     * CPU and NUMA layout of the machine, read from sysfs once. Without
+     * sysfs every online CPU is put on node 0.
+     */
+    class CpuTopology {
+    public:
+        struct Cpu {
+            int id;
+            int node;
+            int package;
+            int core;
+        };
+
+        static const CpuTopology &Get();
+
+        const std::vector<Cpu> &getCpus() const { return m_cpus; }
+
+        int getNodeCount() const { return m_nodeCount; }
+
+        // -1 if cpu is not online
+        int getNodeOfCpu(int cpu) const;
+
+        std::vector<int> getNodeCpus(int node) const;
+
+    private:
+        CpuTopology();
+
+    private:
+        std::vector<Cpu> m_cpus;
+        int m_nodeCount = 1;
+    };
+
+
+    /**
+     * Where the workers of a Scheduler run.
+     *   NONE     leave it to the kernel
+     *   LIST     worker i is pinned to cpus[i % cpus.size()]
+     *   COMPACT  fill up the cores of one node before moving to the next
+     *   SCATTER  spread workers over nodes first, then over cores
+     *   NUMA     pin worker i to all CPUs of a node, node or i % nodes if
+     *            node is -1
+     * nice is applied to every worker when it is not 0.
+     */
+    struct AffinityPolicy {
+        enum Type {
+            NONE,
+            LIST,
+            COMPACT,
+            SCATTER,
+            NUMA
+        };
+
+        Type type = NONE;
+        std::vector<int> cpus;
+        int node = -1;
+        int nice = 0;
+
+        // CPUs worker index may run on, empty means no pinning
+        std::vector<int> cpusFor(size_t index) const;
+
+        bool operator==(const AffinityPolicy &oth) const {
+            return type == oth.type && cpus == oth.cpus
+                   && node == oth.node && nice == oth.nice;
+        }
+
+        static Type FromString(const std::string &str);
+
+        static const char *ToString(Type type);
+    };
+
+    // pin a thread, false if the kernel refuses
+    bool SetThreadAffinity(pthread_t thread, const std::vector<int> &cpus);
+
+    /**
+     * Memory preferring the given node, page aligned. node -1 is plain
+     * malloc. Free with the same size and node.
+     */
+    void *NumaAlloc(size_t size, int node);
+
+    void NumaFree(void *ptr, size_t size, int node);
+
+
+    template<>
+    class LexicalCast<std::string, AffinityPolicy> {
+    public:
+        AffinityPolicy operator()(const std::string &v) {
+            YAML::Node node = YAML::Load(v);
+            AffinityPolicy p;
+            if (node["policy"].IsDefined()) {
+                p.type = AffinityPolicy::FromString(node["policy"].as<std::string>());
+            }
+            if (node["cpus"].IsDefined()) {
+                p.cpus = node["cpus"].as<std::vector<int>>();
+            }
+            if (node["node"].IsDefined()) {
+                p.node = node["node"].as<int>();
+            }
+            if (node["nice"].IsDefined()) {
+                p.nice = node["nice"].as<int>();
+            }
+            return p;
+        }
+    };
+
+    template<>
+    class LexicalCast<AffinityPolicy, std::string> {
+    public:
+        std::string operator()(const AffinityPolicy &p) {
+            YAML::Node node;
+            node["policy"] = AffinityPolicy::ToString(p.type);
+            for (auto cpu : p.cpus) {
+                node["cpus"].push_back(cpu);
+            }
+            node["node"] = p.node;
+            node["nice"] = p.nice;
+            std::stringstream ss;
+            ss << node;
+            return ss.str();
+        }
+    };
+
+}
+
+#endif //MOCKER_AFFINITY_H
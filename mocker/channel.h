@@ -0,0 +1,519 @@
+#ifndef MOCKER_CHANNEL_H
+#define MOCKER_CHANNEL_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <mocker/coroutine.h>
+#include <mocker/log.h>
+#include <mocker/macro.h>
+#include <mocker/mutex.h>
+#include <mocker/schedule.h>
+
+namespace mocker {
+
+    /**
+     * Bounded lock-free MPMC ring (Dmitry Vyukov's). Every cell carries a
+     * sequence number telling whether it is ready to be written or read in
+     * the current lap, so producers and consumers only contend on their own
+     * position counter. The sequence is doubled, 2 * pos writable and
+     * 2 * pos + 1 readable, so a capacity of 1 works as well.
+     * T must be default constructible.
+     */
+    template<class T>
+    class MPMCRing {
+    public:
+        explicit MPMCRing(size_t capacity)
+                : m_capacity(capacity), m_cells(new Cell[capacity]) {
+            MOCKER_ASSERT(capacity > 0);
+            for (size_t i = 0; i < capacity; ++i) {
+                m_cells[i].seq.store(2 * i, std::memory_order_relaxed);
+            }
+            m_enqueuePos.store(0, std::memory_order_relaxed);
+            m_dequeuePos.store(0, std::memory_order_relaxed);
+        }
+
+        ~MPMCRing() {
+            delete[] m_cells;
+        }
+
+        MPMCRing(const MPMCRing &) = delete;
+        MPMCRing &operator=(const MPMCRing &) = delete;
+
+        // value is moved from only on success
+        bool push(T &value) {
+            Cell *cell;
+            size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_cells[pos % m_capacity];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t) seq - (intptr_t) (2 * pos);
+                if (dif == 0) {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = std::move(value);
+            cell->seq.store(2 * pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &value) {
+            Cell *cell;
+            size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_cells[pos % m_capacity];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t) seq - (intptr_t) (2 * pos + 1);
+                if (dif == 0) {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {
+                    return false;
+                } else {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            value = std::move(cell->data);
+            cell->seq.store(2 * (pos + m_capacity), std::memory_order_release);
+            return true;
+        }
+
+        // approximate, a claimed cell may not be written yet
+        bool empty() const {
+            return m_enqueuePos.load() == m_dequeuePos.load();
+        }
+
+        bool full() const {
+            return m_enqueuePos.load() - m_dequeuePos.load() >= m_capacity;
+        }
+
+        size_t capacity() const { return m_capacity; }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        const size_t m_capacity;
+        Cell *const m_cells;
+        // keep the two positions on different cache lines
+        char m_pad0[64];
+        std::atomic<size_t> m_enqueuePos;
+        char m_pad1[64];
+        std::atomic<size_t> m_dequeuePos;
+        char m_pad2[64];
+    };
+
+
+    /**
+     * Typed channel between coroutines. send/recv park the calling
+     * coroutine instead of blocking the thread and the parked coroutine is
+     * put back to its Scheduler when it can go on.
+     *
+     * capacity > 0 is buffered by an MPMCRing; the fast path takes no lock,
+     * the Spinlock only guards the wait queues. capacity == 0 is unbuffered:
+     * a send waits until a receiver takes the value out of its hands.
+     *
+     * Blocking calls must come from a coroutine run by a Scheduler, the
+     * try* calls and close work from anywhere.
+     */
+    template<class T>
+    class Channel {
+    public:
+        typedef std::shared_ptr<Channel> ptr;
+        typedef Spinlock MutexType;
+
+    private:
+        /*
+         * One parked coroutine. A select parks on several channels with the
+         * same WaitState, whoever sets fired first wakes it and the stale
+         * entries are skipped.
+         */
+        struct WaitState {
+            Scheduler *scheduler = nullptr;
+            Coroutine::ptr coroutine;
+            std::atomic<bool> fired{false};
+            // unbuffered handoff, value moved from or into *slot
+            T *slot = nullptr;
+            bool done = false;
+            size_t index = 0;
+
+            explicit WaitState(T *s) : scheduler(Scheduler::GetCurrent()), slot(s) {
+                MOCKER_ASSERT2(scheduler && Coroutine::GetCoroutineId() != 0,
+                               "channels must wait in a scheduled coroutine");
+                coroutine = Coroutine::GetCurrent();
+            }
+
+            void wake() {
+                scheduler->schedule(std::move(coroutine));
+            }
+        };
+
+        struct Waiter {
+            std::shared_ptr<WaitState> state;
+            size_t index;
+        };
+
+        typedef std::list<Waiter> WaitQueue;
+
+    public:
+        explicit Channel(size_t capacity = 0) {
+            if (capacity) {
+                m_ring.reset(new MPMCRing<T>(capacity));
+            }
+        }
+
+        ~Channel() = default;
+
+        Channel(const Channel &) = delete;
+        Channel &operator=(const Channel &) = delete;
+
+        size_t capacity() const { return m_ring ? m_ring->capacity() : 0; }
+
+        bool isClosed() const { return m_closed; }
+
+        // false if the channel is closed
+        bool send(const T &value) {
+            T tmp(value);
+            return send(std::move(tmp));
+        }
+
+        bool send(T &&value) {
+            return m_ring ? sendBuffered(value) : sendUnbuffered(value);
+        }
+
+        // false once the channel is closed and drained
+        bool recv(T &value) {
+            return m_ring ? recvBuffered(value) : recvUnbuffered(value);
+        }
+
+        // never parks, false if the value can not be sent right now
+        bool trySend(T &&value) {
+            if (m_closed) {
+                return false;
+            }
+            if (m_ring) {
+                if (!m_ring->push(value)) {
+                    return false;
+                }
+                wakeOne(m_recvq, m_recvWaiting);
+                return true;
+            }
+            return handoffToReceiver(value);
+        }
+
+        bool trySend(const T &value) {
+            T tmp(value);
+            return trySend(std::move(tmp));
+        }
+
+        bool tryRecv(T &value) {
+            if (m_ring) {
+                if (!m_ring->pop(value)) {
+                    return false;
+                }
+                wakeOne(m_sendq, m_sendWaiting);
+                return true;
+            }
+            return takeFromSender(value);
+        }
+
+        // wake everyone; receivers still drain what is buffered
+        void close() {
+            WaitQueue waiters;
+            {
+                MutexType::Lock lock(m_mutex);
+                if (m_closed) {
+                    return;
+                }
+                m_closed = true;
+                m_recvWaiting -= m_recvq.size();
+                m_sendWaiting -= m_sendq.size();
+                waiters.splice(waiters.end(), m_recvq);
+                waiters.splice(waiters.end(), m_sendq);
+            }
+            for (auto &w : waiters) {
+                if (!w.state->fired.exchange(true)) {
+                    w.state->index = w.index;
+                    w.state->wake();
+                }
+            }
+        }
+
+        /**
+         * Receive from whichever channel is ready first.
+         * @return index of the channel value came from, -1 if all of them
+         *         are closed and drained
+         */
+        static int Select(const std::vector<ptr> &channels, T &value) {
+            // the channel whose wakeOne woke us, its value may still be there
+            size_t woken = channels.size();
+            while (true) {
+                size_t closed = 0;
+                for (size_t i = 0; i < channels.size(); ++i) {
+                    bool is_closed = channels[i]->isClosed();
+                    if (channels[i]->tryRecv(value)) {
+                        // took another one, hand the wake-up to the next receiver
+                        if (woken != channels.size() && woken != i) {
+                            channels[woken]->wakeOne(channels[woken]->m_recvq, channels[woken]->m_recvWaiting);
+                        }
+                        return (int) i;
+                    }
+                    if (is_closed) {
+                        ++closed;
+                    }
+                }
+                if (closed == channels.size()) {
+                    return -1;
+                }
+
+                std::shared_ptr<WaitState> state(new WaitState(&value));
+                size_t registered = 0;
+                while (registered < channels.size()
+                       && channels[registered]->enqueueReceiver(state, registered)) {
+                    ++registered;
+                }
+
+                // a channel got ready while registering, take our wake-up back
+                if (registered < channels.size() && !state->fired.exchange(true)) {
+                    state->coroutine.reset();
+                    woken = channels.size();
+                } else {
+                    Coroutine::Sleep();
+                    woken = state->index;
+                }
+
+                for (size_t i = 0; i < registered; ++i) {
+                    channels[i]->dequeueReceiver(state);
+                }
+                if (state->done) {
+                    return (int) state->index;
+                }
+            }
+        }
+
+    private:
+        bool sendBuffered(T &value) {
+            while (true) {
+                if (m_closed) {
+                    return false;
+                }
+                if (m_ring->push(value)) {
+                    wakeOne(m_recvq, m_recvWaiting);
+                    return true;
+                }
+
+                std::shared_ptr<WaitState> state(new WaitState(nullptr));
+                {
+                    MutexType::Lock lock(m_mutex);
+                    ++m_sendWaiting;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (m_closed || !m_ring->full()) {
+                        --m_sendWaiting;
+                        continue;
+                    }
+                    m_sendq.push_back({state, 0});
+                }
+                Coroutine::Sleep();
+            }
+        }
+
+        bool recvBuffered(T &value) {
+            while (true) {
+                bool closed = m_closed;
+                if (m_ring->pop(value)) {
+                    wakeOne(m_sendq, m_sendWaiting);
+                    return true;
+                }
+                if (closed) {
+                    return false;
+                }
+
+                std::shared_ptr<WaitState> state(new WaitState(nullptr));
+                {
+                    MutexType::Lock lock(m_mutex);
+                    ++m_recvWaiting;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (m_closed || !m_ring->empty()) {
+                        --m_recvWaiting;
+                        continue;
+                    }
+                    m_recvq.push_back({state, 0});
+                }
+                Coroutine::Sleep();
+            }
+        }
+
+        bool sendUnbuffered(T &value) {
+            if (handoffToReceiver(value)) {
+                return true;
+            }
+
+            std::shared_ptr<WaitState> state(new WaitState(&value));
+            {
+                MutexType::Lock lock(m_mutex);
+                if (m_closed) {
+                    return false;
+                }
+                // a receiver may have come between the two locks
+                std::shared_ptr<WaitState> receiver = popLive(m_recvq, m_recvWaiting);
+                if (receiver) {
+                    *receiver->slot = std::move(value);
+                    receiver->done = true;
+                    lock.unlock();
+                    receiver->wake();
+                    return true;
+                }
+                ++m_sendWaiting;
+                m_sendq.push_back({state, 0});
+            }
+            Coroutine::Sleep();
+            return state->done;
+        }
+
+        bool recvUnbuffered(T &value) {
+            if (takeFromSender(value)) {
+                return true;
+            }
+
+            std::shared_ptr<WaitState> state(new WaitState(&value));
+            {
+                MutexType::Lock lock(m_mutex);
+                std::shared_ptr<WaitState> sender = popLive(m_sendq, m_sendWaiting);
+                if (sender) {
+                    value = std::move(*sender->slot);
+                    sender->done = true;
+                    lock.unlock();
+                    sender->wake();
+                    return true;
+                }
+                if (m_closed) {
+                    return false;
+                }
+                ++m_recvWaiting;
+                m_recvq.push_back({state, 0});
+            }
+            Coroutine::Sleep();
+            return state->done;
+        }
+
+        bool handoffToReceiver(T &value) {
+            MutexType::Lock lock(m_mutex);
+            if (m_closed) {
+                return false;
+            }
+            std::shared_ptr<WaitState> receiver = popLive(m_recvq, m_recvWaiting);
+            if (!receiver) {
+                return false;
+            }
+            *receiver->slot = std::move(value);
+            receiver->done = true;
+            lock.unlock();
+            receiver->wake();
+            return true;
+        }
+
+        bool takeFromSender(T &value) {
+            MutexType::Lock lock(m_mutex);
+            std::shared_ptr<WaitState> sender = popLive(m_sendq, m_sendWaiting);
+            if (!sender) {
+                return false;
+            }
+            value = std::move(*sender->slot);
+            sender->done = true;
+            lock.unlock();
+            sender->wake();
+            return true;
+        }
+
+        // first waiter not fired yet, m_mutex must be held
+        std::shared_ptr<WaitState> popLive(WaitQueue &queue, std::atomic<size_t> &waiting) {
+            while (!queue.empty()) {
+                Waiter w = std::move(queue.front());
+                queue.pop_front();
+                --waiting;
+                if (!w.state->fired.exchange(true)) {
+                    w.state->index = w.index;
+                    return w.state;
+                }
+            }
+            return nullptr;
+        }
+
+        // buffered mode, let one parked coroutine retry
+        void wakeOne(WaitQueue &queue, std::atomic<size_t> &waiting) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting == 0) {
+                return;
+            }
+            std::shared_ptr<WaitState> state;
+            {
+                MutexType::Lock lock(m_mutex);
+                state = popLive(queue, waiting);
+            }
+            if (state) {
+                state->wake();
+            }
+        }
+
+        // select registration, false if already ready so select retries
+        bool enqueueReceiver(const std::shared_ptr<WaitState> &state, size_t index) {
+            MutexType::Lock lock(m_mutex);
+            ++m_recvWaiting;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool ready = m_closed || (m_ring ? !m_ring->empty() : hasLive(m_sendq));
+            if (ready) {
+                --m_recvWaiting;
+                return false;
+            }
+            m_recvq.push_back({state, index});
+            return true;
+        }
+
+        void dequeueReceiver(const std::shared_ptr<WaitState> &state) {
+            MutexType::Lock lock(m_mutex);
+            for (auto it = m_recvq.begin(); it != m_recvq.end();) {
+                if (it->state == state) {
+                    it = m_recvq.erase(it);
+                    --m_recvWaiting;
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        bool hasLive(const WaitQueue &queue) const {
+            for (auto &w : queue) {
+                if (!w.state->fired) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        std::unique_ptr<MPMCRing<T>> m_ring;
+        std::atomic<bool> m_closed{false};
+
+        MutexType m_mutex;
+        WaitQueue m_recvq;
+        WaitQueue m_sendq;
+        // queued or queueing, lets the fast path skip m_mutex
+        std::atomic<size_t> m_recvWaiting{0};
+        std::atomic<size_t> m_sendWaiting{0};
+    };
+
+}
+
+#endif //MOCKER_CHANNEL_H
@@ -0,0 +1,239 @@
+#include <mocker/co_sync.h>
+#include <mocker/log.h>
+#include <mocker/macro.h>
+#include <mocker/schedule.h>
+
+namespace mocker {
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoWaitQueue
+    ////////////////////////////////////////////////////////////////////
+    void CoWaitQueue::push() {
+        Scheduler *scheduler = Scheduler::GetCurrent();
+        MOCKER_ASSERT2(scheduler && Coroutine::GetCoroutineId() != 0,
+                       "coroutine primitives must wait in a scheduled coroutine");
+
+        Waiter waiter;
+        waiter.scheduler = scheduler;
+        waiter.coroutine = Coroutine::GetCurrent();
+        m_waiters.push_back(std::move(waiter));
+    }
+
+    void CoWaitQueue::wait(Spinlock::Lock &lock) {
+        push();
+        lock.unlock();
+
+        /*
+         * The waker may schedule us before we are swapped out, the
+         * scheduler will not resume an EXEC coroutine until it is.
+         */
+        Coroutine::Sleep();
+    }
+
+    bool CoWaitQueue::pop(Waiter &waiter) {
+        if (m_waiters.empty()) {
+            return false;
+        }
+        waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+        return true;
+    }
+
+    void CoWaitQueue::Waiter::wake() {
+        scheduler->schedule(std::move(coroutine));
+        scheduler = nullptr;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoMutex
+    ////////////////////////////////////////////////////////////////////
+    void CoMutex::lock() {
+        Spinlock::Lock lock(m_mutex);
+        if (!m_locked) {
+            m_locked = true;
+            return;
+        }
+        // unlock() hands the lock over before waking us
+        m_waiters.wait(lock);
+    }
+
+    bool CoMutex::tryLock() {
+        Spinlock::Lock lock(m_mutex);
+        if (m_locked) {
+            return false;
+        }
+        m_locked = true;
+        return true;
+    }
+
+    void CoMutex::unlock() {
+        CoWaitQueue::Waiter waiter;
+        {
+            Spinlock::Lock lock(m_mutex);
+            MOCKER_ASSERT(m_locked);
+            if (!m_waiters.pop(waiter)) {
+                m_locked = false;
+                return;
+            }
+        }
+        waiter.wake();
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoCondVar
+    ////////////////////////////////////////////////////////////////////
+    void CoCondVar::wait(CoMutex &mutex) {
+        {
+            Spinlock::Lock lock(m_mutex);
+            m_waiters.push();
+        }
+        // released after queueing, so a notify in between is not lost
+        mutex.unlock();
+        Coroutine::Sleep();
+        mutex.lock();
+    }
+
+    void CoCondVar::notify() {
+        CoWaitQueue::Waiter waiter;
+        {
+            Spinlock::Lock lock(m_mutex);
+            if (!m_waiters.pop(waiter)) {
+                return;
+            }
+        }
+        waiter.wake();
+    }
+
+    void CoCondVar::notifyAll() {
+        CoWaitQueue waiters;
+        {
+            Spinlock::Lock lock(m_mutex);
+            waiters.swap(m_waiters);
+        }
+        CoWaitQueue::Waiter waiter;
+        while (waiters.pop(waiter)) {
+            waiter.wake();
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoSemaphore
+    ////////////////////////////////////////////////////////////////////
+    void CoSemaphore::wait() {
+        Spinlock::Lock lock(m_mutex);
+        if (m_count > 0) {
+            --m_count;
+            return;
+        }
+        // notify() passes its count straight to us
+        m_waiters.wait(lock);
+    }
+
+    void CoSemaphore::notify() {
+        CoWaitQueue::Waiter waiter;
+        {
+            Spinlock::Lock lock(m_mutex);
+            if (!m_waiters.pop(waiter)) {
+                ++m_count;
+                return;
+            }
+        }
+        waiter.wake();
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoWaitGroup
+    ////////////////////////////////////////////////////////////////////
+    void CoWaitGroup::add(uint32_t n) {
+        Spinlock::Lock lock(m_mutex);
+        m_count += n;
+    }
+
+    void CoWaitGroup::done() {
+        CoWaitQueue waiters;
+        std::vector<Semaphore *> threads;
+        {
+            Spinlock::Lock lock(m_mutex);
+            MOCKER_ASSERT(m_count > 0);
+            if (--m_count > 0) {
+                return;
+            }
+            waiters.swap(m_waiters);
+            threads.swap(m_threads);
+        }
+        // unlocked, a woken waiter may free us right away
+        CoWaitQueue::Waiter waiter;
+        while (waiters.pop(waiter)) {
+            waiter.wake();
+        }
+        for (auto thread : threads) {
+            thread->notify();
+        }
+    }
+
+    void CoWaitGroup::wait() {
+        Spinlock::Lock lock(m_mutex);
+        if (m_count == 0) {
+            return;
+        }
+        if (Scheduler::GetCurrent() && Coroutine::GetCoroutineId() != 0) {
+            m_waiters.wait(lock);
+            return;
+        }
+        Semaphore semaphore;
+        m_threads.push_back(&semaphore);
+        lock.unlock();
+        semaphore.wait();
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// TaskGroup
+    ////////////////////////////////////////////////////////////////////
+    TaskGroup::TaskGroup(Scheduler *scheduler)
+            : m_scheduler(scheduler ? scheduler : Scheduler::GetCurrent()),
+              m_token(std::make_shared<CancelToken>()) {
+        MOCKER_ASSERT2(m_scheduler, "TaskGroup needs a scheduler");
+    }
+
+    TaskGroup::~TaskGroup() {
+        m_wait.wait();
+    }
+
+    void TaskGroup::spawn(std::function<void()> cb) {
+        m_wait.add();
+        m_scheduler->schedule([this, cb]() {
+            if (!m_token->isCancelled()) {
+                try {
+                    cb();
+                } catch (...) {
+                    {
+                        Spinlock::Lock lock(m_mutex);
+                        if (!m_error) {
+                            m_error = std::current_exception();
+                        }
+                    }
+                    m_token->cancel();
+                }
+            }
+            m_wait.done();
+        });
+    }
+
+    void TaskGroup::join() {
+        m_wait.wait();
+        std::exception_ptr error;
+        {
+            Spinlock::Lock lock(m_mutex);
+            error.swap(m_error);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+}
@@ -0,0 +1,199 @@
+#ifndef MOCKER_CO_SYNC_H
+#define MOCKER_CO_SYNC_H
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <mocker/coroutine.h>
+#include <mocker/mutex.h>
+
+namespace mocker {
+
+    class Scheduler;
+
+    /*
+     * Coroutine level synchronization. A coroutine that has to wait is
+     * parked in a wait queue and its thread goes on with other coroutines.
+     * It is put back to its Scheduler when woken. They must be waited on
+     * from a coroutine run by a Scheduler, releasing works from anywhere.
+     */
+
+    // FIFO queue of parked coroutines, guarded by the owner's Spinlock
+    class CoWaitQueue {
+    public:
+        struct Waiter {
+            Scheduler *scheduler = nullptr;
+            Coroutine::ptr coroutine;
+
+            // schedule the coroutine again, call it without holding a Spinlock
+            void wake();
+        };
+
+        // queue the current coroutine, it parks itself with Coroutine::Sleep
+        void push();
+
+        // push, release lock and park
+        void wait(Spinlock::Lock &lock);
+
+        // take the longest waiting coroutine, false if nobody waits
+        bool pop(Waiter &waiter);
+
+        void swap(CoWaitQueue &other) { m_waiters.swap(other.m_waiters); }
+
+        bool empty() const { return m_waiters.empty(); }
+
+    private:
+        std::list<Waiter> m_waiters;
+    };
+
+
+    /**
+     * Ownership is handed to the first waiter on unlock, so a woken
+     * coroutine never has to compete for the lock again.
+     */
+    class CoMutex {
+    public:
+        typedef ScopedLockImple<CoMutex> Lock;
+
+        CoMutex() = default;
+
+        CoMutex(const CoMutex &) = delete;
+        CoMutex &operator=(const CoMutex &) = delete;
+
+        void lock();
+
+        bool tryLock();
+
+        void unlock();
+
+    private:
+        Spinlock m_mutex;
+        bool m_locked = false;
+        CoWaitQueue m_waiters;
+    };
+
+
+    class CoCondVar {
+    public:
+        CoCondVar() = default;
+
+        CoCondVar(const CoCondVar &) = delete;
+        CoCondVar &operator=(const CoCondVar &) = delete;
+
+        // mutex must be held, it is held again when wait returns
+        void wait(CoMutex &mutex);
+
+        void notify();
+
+        void notifyAll();
+
+    private:
+        Spinlock m_mutex;
+        CoWaitQueue m_waiters;
+    };
+
+
+    class CoSemaphore {
+    public:
+        explicit CoSemaphore(uint32_t count = 0) : m_count(count) {}
+
+        CoSemaphore(const CoSemaphore &) = delete;
+        CoSemaphore &operator=(const CoSemaphore &) = delete;
+
+        void wait();
+
+        void notify();
+
+        uint32_t getCount() const { return m_count; }
+
+    private:
+        Spinlock m_mutex;
+        uint32_t m_count;
+        CoWaitQueue m_waiters;
+    };
+
+
+    /**
+     * Waits for a count of outstanding jobs to drop to zero. Unlike the
+     * primitives above, wait() also works outside a Scheduler: a plain
+     * thread blocks, a coroutine parks.
+     */
+    class CoWaitGroup {
+    public:
+        CoWaitGroup() = default;
+
+        CoWaitGroup(const CoWaitGroup &) = delete;
+        CoWaitGroup &operator=(const CoWaitGroup &) = delete;
+
+        void add(uint32_t n = 1);
+
+        void done();
+
+        void wait();
+
+        uint32_t getCount() const { return m_count; }
+
+    private:
+        Spinlock m_mutex;
+        uint32_t m_count = 0;
+        CoWaitQueue m_waiters;
+        // threads outside a Scheduler, each on its own stack
+        std::vector<Semaphore *> m_threads;
+    };
+
+
+    // set once, polled by tasks at points of their choosing
+    class CancelToken {
+    public:
+        typedef std::shared_ptr<CancelToken> ptr;
+
+        void cancel() { m_cancelled.store(true, std::memory_order_release); }
+
+        bool isCancelled() const { return m_cancelled.load(std::memory_order_acquire); }
+
+    private:
+        std::atomic<bool> m_cancelled{false};
+    };
+
+
+    /**
+     * Coroutines spawned onto a Scheduler and joined together. The first
+     * exception thrown by a task cancels the token of the group and is
+     * rethrown by join(). Tasks not started yet when the group is cancelled
+     * do not run, running ones see getToken()->isCancelled().
+     */
+    class TaskGroup {
+    public:
+        // nullptr spawns onto the Scheduler of the calling thread
+        explicit TaskGroup(Scheduler *scheduler = nullptr);
+
+        // waits for the tasks still running, their exception is dropped
+        ~TaskGroup();
+
+        TaskGroup(const TaskGroup &) = delete;
+        TaskGroup &operator=(const TaskGroup &) = delete;
+
+        void spawn(std::function<void()> cb);
+
+        // wait for every task spawned so far, rethrow the first exception once
+        void join();
+
+        void cancel() { m_token->cancel(); }
+
+        const CancelToken::ptr &getToken() const { return m_token; }
+
+    private:
+        Scheduler *m_scheduler;
+        CancelToken::ptr m_token;
+        CoWaitGroup m_wait;
+        Spinlock m_mutex;
+        std::exception_ptr m_error;
+    };
+
+}
+
+#endif //MOCKER_CO_SYNC_H
@@ -2,73 +2,622 @@
 // Created by ChaosChen on 2021/5/21.
 //
 
-#include <list>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <deque>
+#include <unordered_map>
 #include <mocker/config.h>
 #include <mocker/log.h>
+#include <mocker/schedule.h>
 
 namespace mocker {
 
+    std::atomic<uint64_t> ConfigVarBase::s_generation{1};
+    std::atomic<int> ConfigVarBase::s_publishing{0};
+
+    void ConfigVarBase::ScheduleListener(Scheduler *scheduler, std::function<void()> task) {
+        scheduler->schedule(std::move(task));
+    }
+
     ////////////////////////////////////////////////////////////////////
     /// Config
     ///////////////////////////////////////////////////////////////////
+    /*
+     * Insert-only hash index of the registry, read without locks. Vars are
+     * never unregistered, so a node never changes once linked: readers walk
+     * a bucket while the writer, holding the registry write lock, prepends
+     * to it. Growing links copies of the nodes into a bigger table, the old
+     * tables stay for readers still walking them.
+     */
+    class ConfigIndex {
+    public:
+        ConfigIndex() {
+            grow(1024);
+        }
+
+        ConfigVarBase::ptr find(const std::string &name) const {
+            size_t hash = std::hash<std::string>()(name);
+            const Table *table = m_table.load(std::memory_order_acquire);
+            for (const Node *node = table->buckets[hash & table->mask].load(std::memory_order_acquire);
+                 node; node = node->next) {
+                if (node->hash == hash && node->name == name) {
+                    return node->var;
+                }
+            }
+            return nullptr;
+        }
+
+        // under the registry write lock, name not indexed yet
+        void insert(const std::string &name, const ConfigVarBase::ptr &var) {
+            Table *table = m_table.load(std::memory_order_relaxed);
+            if (m_size >= table->mask + 1) {
+                grow((table->mask + 1) * 2);
+            }
+            link(m_table.load(std::memory_order_relaxed), name, std::hash<std::string>()(name), var);
+            ++m_size;
+        }
+
+    private:
+        struct Node {
+            std::string name;
+            size_t hash;
+            ConfigVarBase::ptr var;
+            Node *next;
+        };
+
+        struct Table {
+            size_t mask;
+            std::unique_ptr<std::atomic<Node *>[]> buckets;
+        };
+
+        void link(Table *table, const std::string &name, size_t hash, const ConfigVarBase::ptr &var) {
+            std::atomic<Node *> &bucket = table->buckets[hash & table->mask];
+            m_nodes.push_back(Node{name, hash, var, bucket.load(std::memory_order_relaxed)});
+            bucket.store(&m_nodes.back(), std::memory_order_release);
+        }
+
+        void grow(size_t buckets) {
+            std::unique_ptr<Table> table(new Table{buckets - 1, std::unique_ptr<std::atomic<Node *>[]>(
+                    new std::atomic<Node *>[buckets])});
+            for (size_t i = 0; i < buckets; ++i) {
+                table->buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+            if (!m_tables.empty()) {
+                Table *old = m_tables.back().get();
+                for (size_t i = 0; i <= old->mask; ++i) {
+                    for (Node *node = old->buckets[i].load(std::memory_order_relaxed); node; node = node->next) {
+                        link(table.get(), node->name, node->hash, node->var);
+                    }
+                }
+            }
+            m_table.store(table.get(), std::memory_order_release);
+            m_tables.push_back(std::move(table));
+        }
+
+    private:
+        std::atomic<Table *> m_table{nullptr};
+        std::vector<std::unique_ptr<Table>> m_tables;
+        // stable addresses, the nodes of every table
+        std::deque<Node> m_nodes;
+        size_t m_size = 0;
+    };
+
+    static ConfigIndex &GetIndex() {
+        static ConfigIndex s_index;
+        return s_index;
+    }
+
     ConfigVarBase::ptr Config::LookupBase(const std::string &name) {
-        RWMutexType::ReadLock lock(GetRWMutex());
+        return GetIndex().find(name);
+    }
+
+    ConfigVarBase::ptr Config::Register(const ConfigVarBase::ptr &var) {
+        const std::string &name = var->getName();
+        RWMutexType::WriteLock lock(GetRWMutex());
+        // another thread may have registered it since the lookup
         auto it = GetData().find(name);
-        return it == GetData().end() ? nullptr : it->second;
+        if (it != GetData().end()) {
+            return it->second;
+        }
+        GetData()[name] = var;
+        GetIndex().insert(name, var);
+        return var;
+    }
+
+    static void HashCombine(uint64_t &seed, uint64_t v) {
+        seed ^= v + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
     }
 
-    static void ListAllMember(const std::string& prefix,
-                              const YAML::Node& node,
-                              std::list<std::pair<std::string, const YAML::Node>>& output) {
+    // hash of a whole subtree, map order matters like it does for the value
+    static uint64_t HashNode(const YAML::Node &node) {
+        uint64_t seed = node.Type();
+        if (node.IsScalar()) {
+            HashCombine(seed, std::hash<std::string>()(node.Scalar()));
+        } else if (node.IsSequence()) {
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                HashCombine(seed, HashNode(*it));
+            }
+        } else if (node.IsMap()) {
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                HashCombine(seed, HashNode(it->first));
+                HashCombine(seed, HashNode(it->second));
+            }
+        }
+        return seed;
+    }
 
+    struct LoadedNode {
+        ConfigVarBase::ptr var;
+        uint64_t hash;
+        // version of the var right after it was set from this node
+        uint64_t version;
+    };
+
+    static std::unordered_map<std::string, LoadedNode> &GetLoadedNodes() {
+        static std::unordered_map<std::string, LoadedNode> s_loaded;
+        return s_loaded;
+    }
 
+    // a var to set from a node, published with the rest of its load
+    struct PreparedNode {
+        std::string name;
+        ConfigVarBase::ptr var;
+        uint64_t hash;
+        ConfigVarBase::Pending::ptr pending;
+    };
+
+    static Mutex &GetLoadMutex() {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    /*
+     * Walk the maps below node and prepare every var named by a key. Returns
+     * the hash of node, children are hashed once on the way back up. A var is
+     * only converted when its subtree changed since the last load, or somebody
+     * set it in between. With several roots, index holds the position in
+     * prepared of every name prepared by this load so far: a later node for
+     * the same name replaces that entry, also when its value is the
+     * published one.
+     */
+    static uint64_t LoadMember(const std::string &prefix, const YAML::Node &node,
+                               std::vector<PreparedNode> &prepared,
+                               std::unordered_map<std::string, size_t> *index) {
         if (prefix.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) {
             MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config invalid name: " << prefix << " : " << node;
-            return;
+            return 0;
         }
 
-        output.push_back(std::make_pair(prefix, node));
-
+        uint64_t hash;
         if (node.IsMap()) {
+            hash = node.Type();
             for (auto it = node.begin(); it != node.end(); ++it) {
-                ListAllMember(prefix.empty() ? it->first.Scalar() : prefix + "." + it->first.Scalar(),
-                              it->second, output);
+                const std::string &key = it->first.Scalar();
+                HashCombine(hash, HashNode(it->first));
+                HashCombine(hash, LoadMember(prefix.empty() ? key : prefix + "." + key, it->second,
+                                             prepared, index));
+            }
+        } else {
+            hash = HashNode(node);
+        }
+
+        if (prefix.empty()) {
+            return hash;
+        }
+        auto &loaded = GetLoadedNodes();
+        auto prev = index ? index->find(prefix) : std::unordered_map<std::string, size_t>::iterator();
+        bool again = index && prev != index->end();
+        if (!again) {
+            auto it = loaded.find(prefix);
+            if (it != loaded.end() && it->second.hash == hash
+                && it->second.version == it->second.var->getVersion()) {
+                return hash;
             }
         }
+        ConfigVarBase::ptr var = Config::LookupBase(prefix);
+        if (!var) {
+            return hash;
+        }
+
+        ConfigVarBase::Pending::ptr pending;
+        if (!var->prepare(node, pending)) {
+            // the value of an earlier root stays
+            if (!again) {
+                loaded.erase(prefix);
+            }
+        } else if (again) {
+            prepared[prev->second] = PreparedNode{prefix, var, hash, pending};
+        } else {
+            if (index) {
+                (*index)[prefix] = prepared.size();
+            }
+            prepared.push_back(PreparedNode{prefix, var, hash, pending});
+        }
+        return hash;
     }
 
     void Config::LoadFromYaml(const YAML::Node &root) {
-        std::list<std::pair<std::string, const YAML::Node>> all_nodes;
-        ListAllMember("", root, all_nodes);
+        LoadFromYaml(std::vector<YAML::Node>{root});
+    }
 
-        for (auto& i : all_nodes) {
-            std::string key = i.first;
-            if (key.empty()) {
-                continue;
+    // unlocked, a listener may load again
+    static void Notify(const std::vector<PreparedNode> &prepared) {
+        for (auto &i : prepared) {
+            if (i.pending) {
+                i.pending->notify();
             }
+        }
+    }
 
-            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-            ConfigVarBase::ptr var = LookupBase(key);
+    void Config::LoadFromYaml(const std::vector<YAML::Node> &roots) {
+        std::vector<PreparedNode> prepared;
+        {
+            Mutex::Lock lock(GetLoadMutex());
+            // a single root can not set a name twice
+            std::unordered_map<std::string, size_t> index;
+            for (auto &root : roots) {
+                LoadMember("", root, prepared, roots.size() > 1 ? &index : nullptr);
+            }
 
-            if (var) {
-                if (i.second.IsScalar()) {
-                    var->fromString(i.second.Scalar());
-                } else {
-                    std::stringstream ss;
-                    ss << i.second;
-                    var->fromString(ss.str());
+            ConfigVarBase::BeginPublish();
+            for (auto &i : prepared) {
+                if (i.pending) {
+                    i.pending->publish();
                 }
             }
+            ConfigVarBase::EndPublish();
+
+            auto &loaded = GetLoadedNodes();
+            for (auto &i : prepared) {
+                loaded[i.name] = LoadedNode{i.var, i.hash, i.var->getVersion()};
+            }
         }
+        Notify(prepared);
     }
 
     void Config::Visit(const std::function<void(ConfigVarBase::ptr)>& cb) {
-        RWMutexType::ReadLock lock(GetRWMutex());
-        ConfigVarMap& m = GetData();
+        ConfigVarMap m;
+        {
+            // cb may look up other vars, the lock is not recursive
+            RWMutexType::ReadLock lock(GetRWMutex());
+            m = GetData();
+        }
 
         for (auto & it : m) {
             cb(it.second);
         }
     }
 
+    void Config::VisitPrefix(const std::string &prefix, const std::function<void(ConfigVarBase::ptr)> &cb) {
+        std::vector<ConfigVarBase::ptr> vars;
+        {
+            RWMutexType::ReadLock lock(GetRWMutex());
+            for (auto it = GetData().lower_bound(prefix);
+                 it != GetData().end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                // the names between "logs" and "logs.~" include logs0 and logs_x
+                if (prefix.empty() || it->first.size() == prefix.size() || prefix.back() == '.'
+                    || it->first[prefix.size()] == '.') {
+                    vars.push_back(it->second);
+                }
+            }
+        }
+
+        for (auto &var : vars) {
+            cb(var);
+        }
+    }
+
+    void Config::ReadConsistent(const std::function<void()> &cb) {
+        while (true) {
+            uint64_t generation = ConfigVarBase::GetGeneration();
+            if (!ConfigVarBase::IsPublishing()) {
+                cb();
+                if (!ConfigVarBase::IsPublishing() && generation == ConfigVarBase::GetGeneration()) {
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// snapshot
+    ////////////////////////////////////////////////////////////////////
+    static const char s_snapshot_magic[8] = {'M', 'O', 'C', 'K', 'C', 'F', 'G', '\0'};
+    static const uint32_t s_snapshot_version = 1;
+
+    /*
+     * The header, then count entries of: uint32 name size, uint32 value size,
+     * uint8 kind, name, value. Native byte order, a snapshot is only read back
+     * by the host that wrote it.
+     */
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        // fingerprints of the files and of the registered vars it was made from
+        uint64_t sources;
+        uint64_t vars;
+        // of the entries following the header
+        uint64_t size;
+        uint64_t checksum;
+    };
+
+    enum SnapshotKind : uint8_t {
+        // fed back as a scalar node, like the YAML had it
+        SNAPSHOT_SCALAR = 0,
+        // serialized YAML, parsed again
+        SNAPSHOT_YAML = 1
+    };
+
+    // FNV-1a over 8 byte words, folded so high bits reach the low ones
+    static uint64_t HashBytes(const char *data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ull;
+            hash ^= hash >> 32;
+        }
+        for (; i < size; ++i) {
+            hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    static bool ReadFile(const std::string &path, std::string &content) {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs) {
+            return false;
+        }
+        std::stringstream ss;
+        ss << ifs.rdbuf();
+        content = ss.str();
+        return true;
+    }
+
+    // the vars named by key paths below node, later roots win
+    static void CollectVars(const std::string &prefix, const YAML::Node &node,
+                            std::map<std::string, std::pair<ConfigVarBase::ptr, SnapshotKind>> &vars) {
+        if (node.IsMap()) {
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                const std::string &key = it->first.Scalar();
+                CollectVars(prefix.empty() ? key : prefix + "." + key, it->second, vars);
+            }
+        }
+        if (prefix.empty()) {
+            return;
+        }
+        ConfigVarBase::ptr var = Config::LookupBase(prefix);
+        if (var) {
+            vars[prefix] = std::make_pair(var, node.IsScalar() ? SNAPSHOT_SCALAR : SNAPSHOT_YAML);
+        }
+    }
+
+    // written aside and renamed, a reader sees the old snapshot or the new one
+    static bool SaveSnapshot(const std::string &path,
+                             const std::map<std::string, std::pair<ConfigVarBase::ptr, SnapshotKind>> &vars,
+                             uint64_t sources, uint64_t var_hash) {
+        std::string body;
+        for (auto &i : vars) {
+            std::string value = i.second.first->toString();
+            uint32_t sizes[2] = {(uint32_t) i.first.size(), (uint32_t) value.size()};
+            body.append((const char *) sizes, sizeof(sizes));
+            body.push_back((char) i.second.second);
+            body.append(i.first);
+            body.append(value);
+        }
+
+        SnapshotHeader header;
+        memcpy(header.magic, s_snapshot_magic, sizeof(header.magic));
+        header.version = s_snapshot_version;
+        header.count = (uint32_t) vars.size();
+        header.sources = sources;
+        header.vars = var_hash;
+        header.size = body.size();
+        header.checksum = HashBytes(body.data(), body.size());
+
+        std::string tmp = path + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+            ofs.write((const char *) &header, sizeof(header));
+            ofs.write(body.data(), body.size());
+            ofs.close();
+            if (!ofs) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config write snapshot " << tmp << " fail";
+                unlink(tmp.c_str());
+                return false;
+            }
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config rename snapshot " << path << " fail, errno="
+                                                << errno << " " << strerror(errno);
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool Config::LoadSnapshot(const std::string &path, uint64_t sources, uint64_t vars) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+            close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        const char *data = (const char *) addr;
+
+        SnapshotHeader header;
+        memcpy(&header, data, sizeof(header));
+        const char *p = data + sizeof(header);
+        const char *end = data + size;
+        if (memcmp(header.magic, s_snapshot_magic, sizeof(header.magic)) != 0
+            || header.version != s_snapshot_version
+            || header.sources != sources || header.vars != vars
+            || header.size != (uint64_t) (end - p)
+            || header.checksum != HashBytes(p, header.size)) {
+            munmap(addr, size);
+            return false;
+        }
+
+        bool ok = true;
+        std::vector<PreparedNode> prepared;
+        std::vector<std::pair<uint8_t, std::string>> values;
+        for (uint32_t i = 0; i < header.count; ++i) {
+            uint32_t sizes[2];
+            if (end - p < (ptrdiff_t) (sizeof(sizes) + 1)) {
+                ok = false;
+                break;
+            }
+            memcpy(sizes, p, sizeof(sizes));
+            uint8_t kind = (uint8_t) p[sizeof(sizes)];
+            p += sizeof(sizes) + 1;
+            if ((uint64_t) (end - p) < (uint64_t) sizes[0] + sizes[1]) {
+                ok = false;
+                break;
+            }
+            prepared.push_back(PreparedNode{std::string(p, sizes[0]), nullptr, 0, nullptr});
+            values.emplace_back(kind, std::string(p + sizes[0], sizes[1]));
+            p += sizes[0] + sizes[1];
+        }
+        munmap(addr, size);
+
+        // the fingerprint says they are all there
+        for (auto &i : prepared) {
+            i.var = LookupBase(i.name);
+            if (!i.var) {
+                ok = false;
+                break;
+            }
+        }
+
+        {
+            Mutex::Lock lock(GetLoadMutex());
+            for (size_t i = 0; ok && i < prepared.size(); ++i) {
+                const std::string &value = values[i].second;
+                try {
+                    ok = prepared[i].var->prepare(values[i].first == SNAPSHOT_SCALAR ? YAML::Node(value)
+                                                                                     : YAML::Load(value),
+                                                  prepared[i].pending);
+                } catch (std::exception &e) {
+                    ok = false;
+                }
+            }
+
+            if (ok) {
+                ConfigVarBase::BeginPublish();
+                for (auto &i : prepared) {
+                    if (i.pending) {
+                        i.pending->publish();
+                    }
+                }
+                ConfigVarBase::EndPublish();
+            }
+        }
+        if (!ok) {
+            MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config snapshot " << path << " does not load, ignored";
+            return false;
+        }
+        Notify(prepared);
+        return true;
+    }
+
+    bool Config::LoadFromConfDir(const std::string &dir, const std::string &snapshot) {
+        std::set<std::string> files = ListConfFiles(dir);
+        std::vector<std::string> contents;
+        uint64_t sources = files.size();
+        for (auto &file : files) {
+            // stat first, a file changing while read gets another mtime
+            struct stat st;
+            std::string content;
+            if (stat(file.c_str(), &st) != 0 || !ReadFile(file, content)) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config read " << file << " fail, errno=" << errno;
+                continue;
+            }
+            HashCombine(sources, std::hash<std::string>()(file));
+            HashCombine(sources, st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec);
+            HashCombine(sources, st.st_size);
+            HashCombine(sources, HashBytes(content.data(), content.size()));
+            contents.push_back(std::move(content));
+        }
+
+        // a var registered since, or of another type, may need a key the snapshot left out
+        uint64_t vars = 0;
+        {
+            RWMutexType::ReadLock lock(GetRWMutex());
+            for (auto &i : GetData()) {
+                HashCombine(vars, std::hash<std::string>()(i.first));
+                HashCombine(vars, std::hash<std::string>()(i.second->getTypeName()));
+            }
+        }
+
+        if (LoadSnapshot(snapshot, sources, vars)) {
+            return true;
+        }
+
+        bool complete = contents.size() == files.size();
+        std::vector<YAML::Node> roots;
+        for (auto &content : contents) {
+            try {
+                roots.push_back(YAML::Load(content));
+            } catch (std::exception &e) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Config parse " << dir << " fail: " << e.what();
+                complete = false;
+            }
+        }
+        LoadFromYaml(roots);
+
+        // a broken file is parsed again next time, not frozen into the snapshot
+        if (complete && !snapshot.empty()) {
+            std::map<std::string, std::pair<ConfigVarBase::ptr, SnapshotKind>> named;
+            for (auto &root : roots) {
+                CollectVars("", root, named);
+            }
+            SaveSnapshot(snapshot, named, sources, vars);
+        }
+        return false;
+    }
+
+    bool Config::IsConfFile(const std::string &name) {
+        auto ends_with = [&name](const std::string &suffix) {
+            return name.size() > suffix.size()
+                   && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        return !name.empty() && name[0] != '.' && (ends_with(".yml") || ends_with(".yaml"));
+    }
+
+    std::set<std::string> Config::ListConfFiles(const std::string &dir) {
+        std::set<std::string> files;
+        DIR *d = opendir(dir.c_str());
+        if (!d) {
+            MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "opendir " << dir << " fail, errno=" << errno;
+            return files;
+        }
+        while (struct dirent *entry = readdir(d)) {
+            if (IsConfFile(entry->d_name)) {
+                files.insert(dir + "/" + entry->d_name);
+            }
+        }
+        closedir(d);
+        return files;
+    }
+
 }
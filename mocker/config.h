@@ -5,6 +5,8 @@
 #ifndef MOCKER_CONFIG_H
 #define MOCKER_CONFIG_H
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -14,20 +16,43 @@
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
 #include <functional>
+#include <thread>
+#include <type_traits>
 #include <boost/lexical_cast.hpp>
 #include <yaml-cpp/yaml.h>
 #include <mocker/log.h>
 #include <mocker/mutex.h>
 
 namespace mocker {
+    class Scheduler;
+
     ////////////////////////////////////////////////////////////////////
     /// ConfigVarBase
     ////////////////////////////////////////////////////////////////////
     class ConfigVarBase {
+    friend class Config;
     public:
         typedef std::shared_ptr<ConfigVarBase> ptr;
 
+        /**
+         * A value converted but not published yet. Config::LoadFromYaml
+         * publishes all of them as one generation, then notifies.
+         */
+        class Pending {
+        public:
+            typedef std::shared_ptr<Pending> ptr;
+
+            virtual ~Pending() {}
+
+            // store the value, no listeners
+            virtual void publish() = 0;
+
+            // the listeners, with the values before and after publish()
+            virtual void notify() = 0;
+        };
+
         ConfigVarBase(const std::string &name, const std::string &description = "")
                 : m_name(name),
                   m_description(description) {
@@ -44,11 +69,62 @@ namespace mocker {
 
         virtual bool fromString(const std::string &val) = 0;
 
+        // scalars as they are, anything else serialized for fromString
+        virtual bool fromNode(const YAML::Node &node) {
+            if (node.IsScalar()) {
+                return fromString(node.Scalar());
+            }
+            std::stringstream ss;
+            ss << node;
+            return fromString(ss.str());
+        }
+
+        /**
+         * Convert node for a later publish. false if it does not convert,
+         * pending is left empty if the value would not change.
+         */
+        virtual bool prepare(const YAML::Node &node, Pending::ptr &pending) = 0;
+
         virtual std::string getTypeName() const = 0;
 
+        // bumped after every published value, starts at 1
+        virtual uint64_t getVersion() const = 0;
+
+        // moves once per publish, a single setValue or a whole load, starts at 1
+        static uint64_t GetGeneration() {
+            return s_generation.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Whether values are being published right now. To read several vars
+         * of one generation: take GetGeneration(), wait while this is true,
+         * read, and retry if this became true or the generation moved.
+         */
+        static bool IsPublishing() {
+            return s_publishing.load(std::memory_order_seq_cst) != 0;
+        }
+
+    protected:
+        // queue task on scheduler, config.h can not see Scheduler
+        static void ScheduleListener(Scheduler *scheduler, std::function<void()> task);
+
+        // bracket the stores of one generation
+        static void BeginPublish() {
+            s_publishing.fetch_add(1, std::memory_order_seq_cst);
+        }
+
+        static void EndPublish() {
+            s_generation.fetch_add(1, std::memory_order_release);
+            s_publishing.fetch_sub(1, std::memory_order_release);
+        }
+
     protected:
         std::string m_name;
         std::string m_description;
+
+    private:
+        static std::atomic<uint64_t> s_generation;
+        static std::atomic<int> s_publishing;
     };
 
 
@@ -69,6 +145,191 @@ namespace mocker {
     };
 
 
+    ////////////////////////////////////////////////////////////////////
+    /// node cast
+    ////////////////////////////////////////////////////////////////////
+    /**
+     * YAML::Node to T. A scalar goes straight to LexicalCast, anything else
+     * is serialized for the string cast of T, so every type with a string
+     * cast works. The containers below convert their element nodes directly
+     * and never go through a string.
+     */
+    template<class T>
+    class FromNode {
+    public:
+        T operator()(const YAML::Node &node) {
+            if (node.IsScalar()) {
+                return LexicalCast<std::string, T>()(node.Scalar());
+            }
+            std::stringstream ss;
+            ss << node;
+            return LexicalCast<std::string, T>()(ss.str());
+        }
+    };
+
+
+    /**
+     * T to YAML::Node, through the string cast of T
+     */
+    template<class T>
+    class ToNode {
+    public:
+        YAML::Node operator()(const T &v) {
+            return YAML::Load(LexicalCast<T, std::string>()(v));
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::vector<T>> {
+    public:
+        std::vector<T> operator()(const YAML::Node &node) {
+            std::vector<T> res;
+            for (size_t i = 0; i < node.size(); ++i) {
+                res.push_back(FromNode<T>()(node[i]));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::vector<T>> {
+    public:
+        YAML::Node operator()(const std::vector<T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node.push_back(ToNode<T>()(i));
+            }
+            return node;
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::list<T>> {
+    public:
+        std::list<T> operator()(const YAML::Node &node) {
+            std::list<T> res;
+            for (size_t i = 0; i < node.size(); ++i) {
+                res.push_back(FromNode<T>()(node[i]));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::list<T>> {
+    public:
+        YAML::Node operator()(const std::list<T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node.push_back(ToNode<T>()(i));
+            }
+            return node;
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::set<T>> {
+    public:
+        std::set<T> operator()(const YAML::Node &node) {
+            std::set<T> res;
+            for (size_t i = 0; i < node.size(); ++i) {
+                res.insert(FromNode<T>()(node[i]));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::set<T>> {
+    public:
+        YAML::Node operator()(const std::set<T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node.push_back(ToNode<T>()(i));
+            }
+            return node;
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::unordered_set<T>> {
+    public:
+        std::unordered_set<T> operator()(const YAML::Node &node) {
+            std::unordered_set<T> res;
+            for (size_t i = 0; i < node.size(); ++i) {
+                res.insert(FromNode<T>()(node[i]));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::unordered_set<T>> {
+    public:
+        YAML::Node operator()(const std::unordered_set<T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node.push_back(ToNode<T>()(i));
+            }
+            return node;
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::map<std::string, T>> {
+    public:
+        std::map<std::string, T> operator()(const YAML::Node &node) {
+            std::map<std::string, T> res;
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                res.insert(std::make_pair(it->first.Scalar(), FromNode<T>()(it->second)));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::map<std::string, T>> {
+    public:
+        YAML::Node operator()(const std::map<std::string, T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node[i.first] = ToNode<T>()(i.second);
+            }
+            return node;
+        }
+    };
+
+
+    template<class T>
+    class FromNode<std::unordered_map<std::string, T>> {
+    public:
+        std::unordered_map<std::string, T> operator()(const YAML::Node &node) {
+            std::unordered_map<std::string, T> res;
+            for (auto it = node.begin(); it != node.end(); ++it) {
+                res.insert(std::make_pair(it->first.Scalar(), FromNode<T>()(it->second)));
+            }
+            return res;
+        }
+    };
+
+    template<class T>
+    class ToNode<std::unordered_map<std::string, T>> {
+    public:
+        YAML::Node operator()(const std::unordered_map<std::string, T> &v) {
+            YAML::Node node;
+            for (auto &i : v) {
+                node[i.first] = ToNode<T>()(i.second);
+            }
+            return node;
+        }
+    };
+
+
     /**
      * For str cast to vector
      * @tparam T vector inner type
@@ -77,15 +338,7 @@ namespace mocker {
     class LexicalCast<std::string, std::vector<T>> {
     public:
         std::vector<T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::vector<T> vec;
-            for (size_t i = 0; i < node.size(); ++i) {
-                ss.str("");
-                ss << node[i];
-                vec.push_back(LexicalCast<std::string, T>()(ss.str()));
-            }
-            return vec;
+            return FromNode<std::vector<T>>()(YAML::Load(v));
         }
     };
 
@@ -98,12 +351,8 @@ namespace mocker {
     class LexicalCast<std::vector<T>, std::string> {
     public:
         std::string operator()(const std::vector<T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::vector<T>>()(v);
             return ss.str();
         }
     };
@@ -117,15 +366,7 @@ namespace mocker {
     class LexicalCast<std::string, std::list<T>> {
     public:
         std::list<T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::list<T> vec;
-            for (size_t i = 0; i < node.size(); ++i) {
-                ss.str("");
-                ss << node[i];
-                vec.push_back(LexicalCast<std::string, T>()(ss.str()));
-            }
-            return vec;
+            return FromNode<std::list<T>>()(YAML::Load(v));
         }
     };
 
@@ -138,12 +379,8 @@ namespace mocker {
     class LexicalCast<std::list<T>, std::string> {
     public:
         std::string operator()(const std::list<T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::list<T>>()(v);
             return ss.str();
         }
     };
@@ -157,15 +394,7 @@ namespace mocker {
     class LexicalCast<std::string, std::set<T>> {
     public:
         std::set<T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::set<T> vec;
-            for (size_t i = 0; i < node.size(); ++i) {
-                ss.str("");
-                ss << node[i];
-                vec.insert(LexicalCast<std::string, T>()(ss.str()));
-            }
-            return vec;
+            return FromNode<std::set<T>>()(YAML::Load(v));
         }
     };
 
@@ -178,12 +407,8 @@ namespace mocker {
     class LexicalCast<std::set<T>, std::string> {
     public:
         std::string operator()(const std::set<T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::set<T>>()(v);
             return ss.str();
         }
     };
@@ -197,15 +422,7 @@ namespace mocker {
     class LexicalCast<std::string, std::unordered_set<T>> {
     public:
         std::unordered_set<T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::unordered_set<T> vec;
-            for (size_t i = 0; i < node.size(); ++i) {
-                ss.str("");
-                ss << node[i];
-                vec.insert(LexicalCast<std::string, T>()(ss.str()));
-            }
-            return vec;
+            return FromNode<std::unordered_set<T>>()(YAML::Load(v));
         }
     };
 
@@ -218,12 +435,8 @@ namespace mocker {
     class LexicalCast<std::unordered_set<T>, std::string> {
     public:
         std::string operator()(const std::unordered_set<T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::unordered_set<T>>()(v);
             return ss.str();
         }
     };
@@ -237,15 +450,7 @@ namespace mocker {
     class LexicalCast<std::string, std::map<std::string, T>> {
     public:
         std::map<std::string, T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::map<std::string, T> vec;
-            for (auto it = node.begin(); it != node.end(); ++it) {
-                ss.str("");
-                ss << it->second;
-                vec.insert(std::make_pair(it->first.Scalar(), LexicalCast<std::string, T>()(ss.str())));
-            }
-            return vec;
+            return FromNode<std::map<std::string, T>>()(YAML::Load(v));
         }
     };
 
@@ -258,12 +463,8 @@ namespace mocker {
     class LexicalCast<std::map<std::string, T>, std::string> {
     public:
         std::string operator()(const std::map<std::string, T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node[i.first] = YAML::Load(LexicalCast<T, std::string>()(i.second));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::map<std::string, T>>()(v);
             return ss.str();
         }
     };
@@ -277,15 +478,7 @@ namespace mocker {
     class LexicalCast<std::string, std::unordered_map<std::string, T>> {
     public:
         std::unordered_map<std::string, T> operator()(const std::string &v) {
-            YAML::Node node = YAML::Load(v);
-            std::stringstream ss;
-            typename std::unordered_map<std::string, T> vec;
-            for (auto it = node.begin(); it != node.end(); ++it) {
-                ss.str("");
-                ss << it->second;
-                vec.insert(std::make_pair(it->first.Scalar(), LexicalCast<std::string, T>()(ss.str())));
-            }
-            return vec;
+            return FromNode<std::unordered_map<std::string, T>>()(YAML::Load(v));
         }
     };
 
@@ -298,12 +491,8 @@ namespace mocker {
     class LexicalCast<std::unordered_map<std::string, T>, std::string> {
     public:
         std::string operator()(const std::unordered_map<std::string, T> &v) {
-            YAML::Node node;
-            for (auto &i : v) {
-                node[i.first] = YAML::Load(LexicalCast<T, std::string>()(i.second));
-            }
             std::stringstream ss;
-            ss << node;
+            ss << ToNode<std::unordered_map<std::string, T>>()(v);
             return ss.str();
         }
     };
@@ -320,11 +509,38 @@ namespace mocker {
     public:
         typedef std::shared_ptr<ConfigVar> ptr;
         typedef std::function<void(const T &old_value, const T &new_value)> on_change_cb;
+        // guards the listeners and serializes setValue
         typedef RWMutex RWMutexType;
+        // never changes once published, setValue swaps in a new one
+        typedef std::shared_ptr<const T> Snapshot;
+
+        /**
+         * Cached reader for hot paths, keep one per thread (static thread_local).
+         * get() reloads the snapshot only after the version moved, otherwise
+         * it is a load and a compare: no lock, no copy.
+         */
+        class View {
+        public:
+            explicit View(const ptr &var) : m_var(var) {}
+
+            const T &get() {
+                uint64_t version = m_var->getVersion();
+                if (version != m_version) {
+                    m_value = m_var->getSnapshot();
+                    m_version = version;
+                }
+                return *m_value;
+            }
+
+        private:
+            ptr m_var;
+            uint64_t m_version = 0;
+            Snapshot m_value;
+        };
 
         ConfigVar(const std::string &name, const T &default_value, const std::string &description = "")
                 : ConfigVarBase(name, description),
-                  m_val(default_value) {
+                  m_val(std::make_shared<const T>(default_value)) {
 
         }
 
@@ -334,7 +550,7 @@ namespace mocker {
                 return ToStr()(getValue());
             } catch (std::exception &e) {
                 MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar::ToString exception"
-                                                    << e.what() << " convert: " << typeid(m_val).name() << " to string";
+                                                    << e.what() << " convert: " << typeid(T).name() << " to string";
             }
             return "";
         }
@@ -346,37 +562,95 @@ namespace mocker {
                 return true;
             } catch (std::exception &e) {
                 MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar::FromString exception"
-                                                    << e.what() << " convert: string to " << typeid(m_val).name();
+                                                    << e.what() << " convert: string to " << typeid(T).name();
                 return false;
             }
         }
 
+        // a copy, prefer getSnapshot() or a View for containers
         T getValue() {
-            RWMutexType::ReadLock lock(m_rwmutex);
-            return m_val;
+            return *getSnapshot();
+        }
+
+        Snapshot getSnapshot() const {
+            return std::atomic_load(&m_val);
+        }
+
+        uint64_t getVersion() const override {
+            return m_version.load(std::memory_order_acquire);
         }
 
         void setValue(const T &v) {
+            Snapshot old_value;
+            Snapshot value;
+            uint64_t version;
+            std::vector<Listener> listeners;
             {
-                RWMutexType::ReadLock lock(m_rwmutex);
-                if (v == m_val) {
+                // compare and store under one lock, two setters never see the same old value
+                RWMutexType::WriteLock lock(m_rwmutex);
+                old_value = getSnapshot();
+                if (v == *old_value) {
                     return;
                 }
-                for (auto &callback : m_cbs) {
-                    callback.second(m_val, v);
-                }
+                listeners = getListeners();
+                value = std::make_shared<const T>(v);
+                BeginPublish();
+                store(value);
+                EndPublish();
+                version = getVersion();
             }
-            RWMutexType::WriteLock lock(m_rwmutex);
-            m_val = v;
+            // listeners run unlocked, they may read or set this var again
+            notify(listeners, old_value, value, version, false);
+            notify(listeners, old_value, value, version, true);
+        }
+
+        bool fromNode(const YAML::Node &node) override {
+            try {
+                setValue(*convert(node));
+                return true;
+            } catch (std::exception &e) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar::FromNode exception"
+                                                    << e.what() << " convert: node to " << typeid(T).name();
+                return false;
+            }
+        }
+
+        bool prepare(const YAML::Node &node, Pending::ptr &pending) override {
+            Snapshot value;
+            try {
+                value = convert(node);
+            } catch (std::exception &e) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar::prepare exception"
+                                                    << e.what() << " convert: node to " << typeid(T).name();
+                return false;
+            }
+            if (!(*value == *getSnapshot())) {
+                pending = std::make_shared<PendingValue>(this, value);
+            }
+            return true;
         }
 
         std::string getTypeName() const override { return typeid(T).name(); }
 
-        uint64_t addListener(on_change_cb cb) {
+        /**
+         * Listeners run, or are queued, after the value is stored, those with
+         * a higher priority first. With a scheduler the listener runs there,
+         * and changes arriving before it ran are coalesced: it is called once,
+         * from the oldest undelivered value to the latest. Exceptions thrown
+         * by a listener are logged and never reach the setter.
+         */
+        uint64_t addListener(on_change_cb cb, int priority = 0, Scheduler *scheduler = nullptr) {
             static uint64_t s_fun_id = 0;
+            Listener listener;
+            listener.cb = std::move(cb);
+            listener.priority = priority;
+            listener.scheduler = scheduler;
+            if (scheduler) {
+                listener.state = std::make_shared<AsyncState>();
+            }
             RWMutexType::WriteLock lock(m_rwmutex);
             ++s_fun_id;
-            m_cbs[s_fun_id] = cb;
+            m_cbs[s_fun_id] = listener;
             return s_fun_id;
         }
 
@@ -388,7 +662,7 @@ namespace mocker {
         on_change_cb getListener(uint64_t key) {
             RWMutexType::ReadLock lock(m_rwmutex);
             auto it = m_cbs.find(key);
-            return it == m_cbs.end() ? nullptr : it->second;
+            return it == m_cbs.end() ? nullptr : it->second.cb;
         }
 
         void clearListener() {
@@ -397,10 +671,160 @@ namespace mocker {
         }
 
     private:
-        T m_val;
+        /*
+         * A change waiting for its queued listener call. Setters notify
+         * unlocked, so their calls may arrive out of order: the versions keep
+         * the oldest undelivered value and the latest one.
+         */
+        struct AsyncState {
+            Spinlock mutex;
+            bool scheduled = false;
+            Snapshot oldValue;
+            uint64_t oldVersion = 0;
+            Snapshot newValue;
+            uint64_t newVersion = 0;
+            // newest version a queued call has taken
+            uint64_t delivered = 0;
+        };
+
+        struct Listener {
+            on_change_cb cb;
+            int priority = 0;
+            // nullptr runs the listener in the setter
+            Scheduler *scheduler = nullptr;
+            std::shared_ptr<AsyncState> state;
+        };
+
+        // highest priority first, hold m_rwmutex
+        std::vector<Listener> getListeners() const {
+            std::vector<Listener> res;
+            for (auto &i : m_cbs) {
+                res.push_back(i.second);
+            }
+            std::stable_sort(res.begin(), res.end(), [](const Listener &a, const Listener &b) {
+                return a.priority > b.priority;
+            });
+            return res;
+        }
+
+        static void Call(const on_change_cb &cb, const T &old_value, const T &new_value) {
+            try {
+                cb(old_value, new_value);
+            } catch (std::exception &e) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar listener exception " << e.what();
+            } catch (...) {
+                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "ConfigVar listener unknown exception";
+            }
+        }
+
+        // the synchronous or the scheduled listeners
+        // version is the one new_value was stored with
+        static void notify(const std::vector<Listener> &listeners, const Snapshot &old_value,
+                           const Snapshot &new_value, uint64_t version, bool scheduled) {
+            for (auto &listener : listeners) {
+                if (!!listener.scheduler != scheduled) {
+                    continue;
+                }
+                if (!scheduled) {
+                    Call(listener.cb, *old_value, *new_value);
+                    continue;
+                }
+
+                std::shared_ptr<AsyncState> state = listener.state;
+                {
+                    Spinlock::Lock lock(state->mutex);
+                    // a queued call already went past it
+                    if (version <= state->delivered) {
+                        continue;
+                    }
+                    if (version > state->newVersion) {
+                        state->newValue = new_value;
+                        state->newVersion = version;
+                    }
+                    if (state->scheduled) {
+                        if (version < state->oldVersion) {
+                            state->oldValue = old_value;
+                            state->oldVersion = version;
+                        }
+                        continue;
+                    }
+                    state->oldValue = old_value;
+                    state->oldVersion = version;
+                    state->scheduled = true;
+                }
+                on_change_cb cb = listener.cb;
+                ScheduleListener(listener.scheduler, [state, cb]() {
+                    Snapshot old_value, new_value;
+                    {
+                        Spinlock::Lock lock(state->mutex);
+                        old_value.swap(state->oldValue);
+                        new_value.swap(state->newValue);
+                        state->delivered = state->newVersion;
+                        state->scheduled = false;
+                    }
+                    // changed back and forth meanwhile
+                    if (!(*old_value == *new_value)) {
+                        Call(cb, *old_value, *new_value);
+                    }
+                });
+            }
+        }
+
+        class PendingValue : public Pending {
+        public:
+            PendingValue(ConfigVar *var, const Snapshot &value)
+                    : m_var(var), m_value(value) {}
+
+            void publish() override {
+                RWMutexType::WriteLock lock(m_var->m_rwmutex);
+                m_old = m_var->getSnapshot();
+                m_var->store(m_value);
+                m_version = m_var->getVersion();
+            }
+
+            void notify() override {
+                std::vector<Listener> listeners;
+                {
+                    RWMutexType::ReadLock lock(m_var->m_rwmutex);
+                    listeners = m_var->getListeners();
+                }
+                ConfigVar::notify(listeners, m_old, m_value, m_version, false);
+                ConfigVar::notify(listeners, m_old, m_value, m_version, true);
+            }
+
+        private:
+            // vars are never dropped from Config
+            ConfigVar *m_var;
+            Snapshot m_value;
+            Snapshot m_old;
+            uint64_t m_version = 0;
+        };
+
+        // a custom FromStr wins over the node cast
+        Snapshot convert(const YAML::Node &node) {
+            if (std::is_same<FromStr, LexicalCast<std::string, T>>::value) {
+                return std::make_shared<const T>(FromNode<T>()(node));
+            }
+            if (node.IsScalar()) {
+                return std::make_shared<const T>(FromStr()(node.Scalar()));
+            }
+            std::stringstream ss;
+            ss << node;
+            return std::make_shared<const T>(FromStr()(ss.str()));
+        }
+
+        // hold m_rwmutex for writing
+        void store(const Snapshot &value) {
+            std::atomic_store(&m_val, value);
+            m_version.fetch_add(1, std::memory_order_release);
+        }
+
+    private:
+        Snapshot m_val;
+        std::atomic<uint64_t> m_version{1};
         // Change the callback function group, the uint64_t key must be
         // unique, generally hash can be used
-        std::map<uint64_t, on_change_cb> m_cbs;
+        std::map<uint64_t, Listener> m_cbs;
 
         RWMutexType m_rwmutex;
     };
@@ -425,34 +849,29 @@ namespace mocker {
         static typename ConfigVar<T>::ptr Lookup(const std::string &name,
                                                  const T &default_value,
                                                  const std::string &description = "") {
-            {
-                RWMutexType::ReadLock lock(GetRWMutex());
-                auto it = GetData().find(name);
-                if (it != GetData().end()) {
-                    auto tmp = std::dynamic_pointer_cast<ConfigVar<T>>(it->second);
-                    if (tmp) {
-                        MOCKER_LOG_INFO(MOCKER_LOG_ROOT()) << "Lookup name=" << name << " exists";
-                        return tmp;
-                    } else {
-                        MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Lookup name=" << name << " exists but type not "
-                                                            << typeid(T).name() << " real_type="
-                                                            << it->second->getTypeName()
-                                                            << " " << it->second->toString();
-                        return nullptr;
-                    }
+            ConfigVarBase::ptr var = LookupBase(name);
+            if (!var) {
+                if (name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) {
+                    MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Lookup name invalid " << name;
+                    throw std::invalid_argument(name);
+                }
+                typename ConfigVar<T>::ptr v(new ConfigVar<T>(name, default_value, description));
+                var = Register(v);
+                if (var == v) {
+                    return v;
                 }
-            }
-            if (name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) {
-                MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Lookup name invalid " << name;
-                throw std::invalid_argument(name);
             }
 
-            typename ConfigVar<T>::ptr v(new ConfigVar<T>(name, default_value, description));
-            {
-                RWMutexType::WriteLock lock(GetRWMutex());
-                GetData()[name] = v;
+            auto tmp = std::dynamic_pointer_cast<ConfigVar<T>>(var);
+            if (tmp) {
+                MOCKER_LOG_INFO(MOCKER_LOG_ROOT()) << "Lookup name=" << name << " exists";
+                return tmp;
             }
-            return v;
+            MOCKER_LOG_ERROR(MOCKER_LOG_ROOT()) << "Lookup name=" << name << " exists but type not "
+                                                << typeid(T).name() << " real_type="
+                                                << var->getTypeName()
+                                                << " " << var->toString();
+            return nullptr;
         }
 
         /**
@@ -463,20 +882,56 @@ namespace mocker {
          */
         template<class T>
         static typename ConfigVar<T>::ptr Lookup(const std::string &name) {
-            RWMutexType::ReadLock lock(GetRWMutex());
-            auto it = GetData().find(name);
-            if (it == GetData().end()) {
-                return nullptr;
-            }
-            return std::dynamic_pointer_cast<ConfigVar<T>>(it->second);
+            return std::dynamic_pointer_cast<ConfigVar<T>>(LookupBase(name));
         }
 
+        /**
+         * Set every registered var named by a key path of root. Reloads are
+         * incremental: vars whose subtree hashes the same as at the last load
+         * are skipped, unless they were set in between. All changed vars are
+         * converted first and published as one generation, the listeners run
+         * after that on the calling thread.
+         */
         static void LoadFromYaml(const YAML::Node &root);
+
+        // like above, one generation for all roots, later roots win
+        static void LoadFromYaml(const std::vector<YAML::Node> &roots);
+        // lock-free, vars are never unregistered
         static ConfigVarBase::ptr LookupBase(const std::string &name);
 
+        // in name order, on a copy: cb may look up or register vars
         static void Visit(const std::function<void(ConfigVarBase::ptr)>& cb);
 
+        // the var named prefix and those below it, "logs" visits logs.* but not logs_x
+        static void VisitPrefix(const std::string &prefix, const std::function<void(ConfigVarBase::ptr)> &cb);
+
+        /**
+         * Run cb until it ran entirely within one generation, so the vars it
+         * reads all belong to the same load. cb may run more than once.
+         */
+        static void ReadConsistent(const std::function<void()> &cb);
+
+        /**
+         * Load the YAML files of dir through a binary snapshot of the values
+         * they resolve to, kept in the file snapshot. The snapshot is used
+         * while every file keeps its mtime, size and content hash and the
+         * process registered the same vars; otherwise the files are parsed
+         * and the snapshot written again. Returns whether it was used.
+         */
+        static bool LoadFromConfDir(const std::string &dir, const std::string &snapshot);
+
+        // .yml and .yaml, hidden files excluded
+        static bool IsConfFile(const std::string &name);
+
+        static std::set<std::string> ListConfFiles(const std::string &dir);
+
     private:
+        // add var unless its name is taken, returns the var registered under the name
+        static ConfigVarBase::ptr Register(const ConfigVarBase::ptr &var);
+
+        // set the vars from a snapshot made from sources and vars, false if it does not fit
+        static bool LoadSnapshot(const std::string &path, uint64_t sources, uint64_t vars);
+
         /**
          * The reason why the static member s_data is not directly defined
          * here is because the order of initialization cannot be guaranteed
@@ -497,6 +952,77 @@ namespace mocker {
         }
 
     };
+
+    ////////////////////////////////////////////////////////////////////
+    /// ConfigHandle
+    ////////////////////////////////////////////////////////////////////
+
+    /**
+     * A config var looked up once, when the handle is constructed, usually
+     * as a static. get() returns a copy cached per thread, refreshed when the
+     * global generation moved: a load and a compare while nothing changes.
+     * A refresh never picks up a value of a half published generation, use
+     * Config::ReadConsistent to read several vars of the same one.
+     * T must be default constructible.
+     */
+    template<class T>
+    class ConfigHandle {
+    public:
+        ConfigHandle(const std::string &name, const T &default_value, const std::string &description = "")
+                : m_var(Config::Lookup<T>(name, default_value, description)),
+                  m_slot(GetSlotCount()++) {
+            if (!m_var) {
+                throw std::invalid_argument(name);
+            }
+        }
+
+        // by value, a later refresh on this thread rewrites the cached entry
+        T get() const {
+            std::deque<Entry> &entries = GetEntries();
+            if (m_slot >= entries.size()) {
+                entries.resize(m_slot + 1);
+            }
+            Entry &entry = entries[m_slot];
+            if (entry.generation != ConfigVarBase::GetGeneration()) {
+                // never keep a value from a half published generation
+                while (true) {
+                    uint64_t generation = ConfigVarBase::GetGeneration();
+                    if (!ConfigVarBase::IsPublishing()) {
+                        entry.value = m_var->getValue();
+                        if (!ConfigVarBase::IsPublishing() && generation == ConfigVarBase::GetGeneration()) {
+                            entry.generation = generation;
+                            break;
+                        }
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            return entry.value;
+        }
+
+        const typename ConfigVar<T>::ptr &getVar() const { return m_var; }
+
+    private:
+        struct Entry {
+            uint64_t generation = 0;
+            T value;
+        };
+
+        // one entry per handle of this type, a deque keeps references stable
+        static std::deque<Entry> &GetEntries() {
+            static thread_local std::deque<Entry> t_entries;
+            return t_entries;
+        }
+
+        static std::atomic<size_t> &GetSlotCount() {
+            static std::atomic<size_t> s_slots{0};
+            return s_slots;
+        }
+
+    private:
+        typename ConfigVar<T>::ptr m_var;
+        size_t m_slot;
+    };
 }
 
 #endif //MOCKER_CONFIG_H
@@ -0,0 +1,156 @@
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include <mocker/config.h>
+#include <mocker/config_watcher.h>
+#include <mocker/log.h>
+#include <mocker/macro.h>
+#include <mocker/util.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    // a burst never delays a reload longer than this many debounce periods
+    static const uint64_t s_max_debounce_periods = 10;
+
+    ConfigWatcher::ConfigWatcher(const std::string &dir, uint64_t debounce_ms)
+            : m_dir(dir), m_debounceMs(debounce_ms) {
+    }
+
+    ConfigWatcher::~ConfigWatcher() {
+        stop();
+    }
+
+    bool ConfigWatcher::start() {
+        if (m_thread) {
+            return true;
+        }
+        m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotifyFd < 0) {
+            MOCKER_LOG_ERROR(g_logger) << "inotify_init1 fail, errno=" << errno << " " << strerror(errno);
+            return false;
+        }
+        // editors often save by writing a temporary file and renaming it
+        if (inotify_add_watch(m_inotifyFd, m_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            MOCKER_LOG_ERROR(g_logger) << "inotify_add_watch " << m_dir << " fail, errno=" << errno
+                                       << " " << strerror(errno);
+            close(m_inotifyFd);
+            m_inotifyFd = -1;
+            return false;
+        }
+        m_wakeFd = eventfd(0, EFD_CLOEXEC);
+        MOCKER_ASSERT(m_wakeFd >= 0);
+
+        // changes from now on are queued by inotify, nothing falls in between
+        reload();
+        m_thread.reset(new Thread(std::bind(&ConfigWatcher::run, this), "config_watch"));
+        return true;
+    }
+
+    void ConfigWatcher::stop() {
+        if (!m_thread) {
+            return;
+        }
+        uint64_t one = 1;
+        ssize_t rt = write(m_wakeFd, &one, sizeof(one));
+        MOCKER_ASSERT(rt == sizeof(one));
+        m_thread->join();
+        m_thread.reset();
+        close(m_inotifyFd);
+        close(m_wakeFd);
+        m_inotifyFd = m_wakeFd = -1;
+    }
+
+    void ConfigWatcher::run() {
+        bool changed = false;
+        uint64_t first_change = 0;
+        uint64_t last_change = 0;
+        alignas(struct inotify_event) char buf[4096];
+
+        while (true) {
+            int timeout = -1;
+            if (changed) {
+                // quiet for the debounce time, or a burst went on too long
+                uint64_t due = std::min(last_change + m_debounceMs,
+                                        first_change + m_debounceMs * s_max_debounce_periods);
+                uint64_t now = GetCurrentMS();
+                if (now >= due) {
+                    reload();
+                    changed = false;
+                    continue;
+                }
+                timeout = (int) (due - now);
+            }
+
+            pollfd fds[2];
+            fds[0].fd = m_inotifyFd;
+            fds[0].events = POLLIN;
+            fds[1].fd = m_wakeFd;
+            fds[1].events = POLLIN;
+            int rt = poll(fds, 2, timeout);
+            if (rt < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                MOCKER_LOG_ERROR(g_logger) << "poll fail, errno=" << errno << " " << strerror(errno);
+                return;
+            }
+            if (fds[1].revents) {
+                return;
+            }
+
+            bool was_changed = changed;
+            while (true) {
+                ssize_t n = read(m_inotifyFd, buf, sizeof(buf));
+                if (n <= 0) {
+                    break;
+                }
+                for (char *p = buf; p < buf + n;) {
+                    auto *event = (struct inotify_event *) p;
+                    p += sizeof(struct inotify_event) + event->len;
+                    // events were lost, or a file changed
+                    if ((event->mask & IN_Q_OVERFLOW) || (event->len && Config::IsConfFile(event->name))) {
+                        changed = true;
+                        last_change = GetCurrentMS();
+                    }
+                }
+            }
+            if (!was_changed && changed) {
+                first_change = last_change;
+            }
+        }
+    }
+
+    /*
+     * Every file in ListConfFiles order, as LoadFromConfDir does, so later
+     * files keep winning. The subtree hashes skip the vars nothing changed.
+     */
+    void ConfigWatcher::reload() {
+        std::set<std::string> files = Config::ListConfFiles(m_dir);
+        std::vector<YAML::Node> roots;
+        for (auto &file : files) {
+            try {
+                roots.push_back(YAML::LoadFile(file));
+            } catch (std::exception &e) {
+                // a writer still busy with it triggers another event
+                MOCKER_LOG_ERROR(g_logger) << "ConfigWatcher load " << file << " fail: " << e.what();
+            }
+        }
+        if (roots.empty()) {
+            return;
+        }
+        uint64_t begin = GetCurrentUS();
+        Config::LoadFromYaml(roots);
+        ++m_reloads;
+        MOCKER_LOG_INFO(g_logger) << "ConfigWatcher reloaded " << roots.size() << " files of " << m_dir
+                                  << " in " << GetCurrentUS() - begin << "us";
+    }
+
+}
@@ -0,0 +1,61 @@
+#ifndef MOCKER_CONFIG_WATCHER_H
+#define MOCKER_CONFIG_WATCHER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <mocker/thread.h>
+
+namespace mocker {
+
+    /**
+     * Hot reload of the YAML files (.yml, .yaml) of one directory. A thread
+     * waits on inotify for files written or moved in, waits until the
+     * directory stayed quiet for the debounce time, then parses all files
+     * and hands them to one Config::LoadFromYaml, later files winning as in
+     * LoadFromConfDir: only changed keys are set, all of them as one
+     * generation, and the listeners run on the watcher thread instead of the
+     * threads reading the config.
+     *
+     * Deleting a file keeps the values it set.
+     */
+    class ConfigWatcher {
+    public:
+        typedef std::shared_ptr<ConfigWatcher> ptr;
+
+        explicit ConfigWatcher(const std::string &dir, uint64_t debounce_ms = 100);
+
+        ~ConfigWatcher();
+
+        ConfigWatcher(const ConfigWatcher &) = delete;
+        ConfigWatcher &operator=(const ConfigWatcher &) = delete;
+
+        // load every file once, then watch, false if dir can not be watched
+        bool start();
+
+        void stop();
+
+        const std::string &getDir() const { return m_dir; }
+
+        // loads done by the watcher thread
+        uint64_t getReloadCount() const { return m_reloads; }
+
+    private:
+        void run();
+
+        void reload();
+
+    private:
+        std::string m_dir;
+        uint64_t m_debounceMs;
+        int m_inotifyFd = -1;
+        // stop() wakes the watcher thread through it
+        int m_wakeFd = -1;
+        Thread::ptr m_thread;
+        std::atomic<uint64_t> m_reloads{0};
+    };
+
+}
+
+#endif //MOCKER_CONFIG_WATCHER_H
@@ -2,13 +2,20 @@
 // Created by ChaosChen on 2021/7/31.
 //
 
+#include <execinfo.h>
+#include <algorithm>
 #include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
 #include <utility>
 #include <mocker/coroutine.h>
+#include <mocker/affinity.h>
 #include <mocker/config.h>
 #include <mocker/macro.h>
 #include <mocker/log.h>
 #include <mocker/schedule.h>
+#include <mocker/util.h>
 
 namespace mocker {
     static std::atomic<uint64_t> s_coroutine_id{0};
@@ -16,26 +23,266 @@ namespace mocker {
 
     static thread_local Coroutine *t_coroutine = nullptr;
     static thread_local Coroutine::ptr t_threadCoroutine = nullptr;
+    // gettid() is a syscall, swapIn records it every time
+    static thread_local pid_t t_threadId = 0;
 
-    static ConfigVar<uint32_t>::ptr g_coroutine_stack_size =
-            Config::Lookup<uint32_t>("coroutine.stack_size",
-                                     1024 * 1024,
-                                     "coroutine stack size");
+    // read by every new coroutine
+    static ConfigHandle<uint32_t> g_coroutine_stack_size("coroutine.stack_size",
+                                                         1024 * 1024,
+                                                         "coroutine stack size");
 
     static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
 
-    class MallocStackAllocator {
+    static ConfigHandle<bool> g_coroutine_stack_numa_local("coroutine.stack_numa_local", true,
+                                                           "allocate stacks on the node of a pinned thread");
+
+    // node -1 is plain malloc, otherwise mmap preferring that node
+    class NumaStackAllocator {
     public:
-        static void *Alloc(size_t size) {
-            return malloc(size);
+        static void *Alloc(size_t size, int node) {
+            return NumaAlloc(size, node);
         }
 
-        static void Dealloc(void *vp, size_t size) {
-            return free(vp);
+        static void Dealloc(void *vp, size_t size, int node) {
+            NumaFree(vp, size, node);
         }
     };
 
-    using StackAllocator = MallocStackAllocator;
+    using StackAllocator = NumaStackAllocator;
+
+    // read by every new coroutine
+    static ConfigHandle<bool> g_coroutine_debug_backtrace("coroutine.debug_backtrace", false,
+                                                          "keep where coroutines were created and last yielded");
+
+    // stamps every state change, a few ms of resolution are plenty for a hang
+    static uint64_t StateClockUS() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+    }
+
+    static pid_t CurrentThreadId() {
+        if (!t_threadId) {
+            t_threadId = GetThreadId();
+        }
+        return t_threadId;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoroutineLocals
+    ////////////////////////////////////////////////////////////////////
+    static std::atomic<size_t> s_local_slots{0};
+    static void (*s_local_destroy[CoroutineLocals::kMaxSlots])(void *);
+
+    // outside of coroutines, freed with the thread
+    static thread_local CoroutineLocals t_thread_locals;
+
+    CoroutineLocals::~CoroutineLocals() {
+        clear();
+    }
+
+    void CoroutineLocals::clear() {
+        // like pthread keys, give up on destructors setting values forever
+        for (int pass = 0; pass < 4; ++pass) {
+            bool found = false;
+            for (size_t slot = 0; slot < kInlineSlots + m_more.size(); ++slot) {
+                void *&value = at(slot);
+                if (value) {
+                    void *tmp = value;
+                    value = nullptr;
+                    s_local_destroy[slot](tmp);
+                    found = true;
+                }
+            }
+            if (!found) {
+                break;
+            }
+        }
+        m_more.clear();
+    }
+
+    size_t CoroutineLocals::Register(void (*destroy)(void *)) {
+        size_t slot = s_local_slots.fetch_add(1);
+        MOCKER_ASSERT2(slot < kMaxSlots, "too many CoroutineLocal");
+        s_local_destroy[slot] = destroy;
+        return slot;
+    }
+
+    CoroutineLocals &CoroutineLocals::Current() {
+        // the main coroutine of a thread has no stack, it is the thread
+        if (t_coroutine && t_coroutine->m_stack) {
+            return t_coroutine->m_locals;
+        }
+        return t_thread_locals;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// CoroutineRegistry
+    ////////////////////////////////////////////////////////////////////
+    struct Coroutine::Backtraces {
+        static const int kFrames = 16;
+        void *created[kFrames];
+        int createdSize = 0;
+        void *suspended[kFrames];
+        int suspendedSize = 0;
+    };
+
+    static const uint32_t s_registry_shards = 16;
+
+    struct RegistryShard {
+        Mutex mutex{"coroutine_registry"};
+        Coroutine *head = nullptr;
+    };
+
+    // coroutines may be created during static initialization
+    static RegistryShard *GetShards() {
+        static RegistryShard shards[s_registry_shards];
+        return shards;
+    }
+
+    static std::string Symbolize(const std::vector<void *> &frames) {
+        std::stringstream ss;
+        char **symbols = backtrace_symbols(frames.data(), (int) frames.size());
+        if (symbols) {
+            for (size_t i = 0; i < frames.size(); ++i) {
+                ss << "\t" << symbols[i] << std::endl;
+            }
+            free(symbols);
+        }
+        return ss.str();
+    }
+
+    void CoroutineRegistry::Register(Coroutine *cort) {
+        cort->m_shard = CurrentThreadId() % s_registry_shards;
+        RegistryShard &shard = GetShards()[cort->m_shard];
+        Mutex::Lock lock(shard.mutex);
+        cort->m_next = shard.head;
+        if (shard.head) {
+            shard.head->m_prev = cort;
+        }
+        shard.head = cort;
+    }
+
+    void CoroutineRegistry::Unregister(Coroutine *cort) {
+        RegistryShard &shard = GetShards()[cort->m_shard];
+        Mutex::Lock lock(shard.mutex);
+        if (cort->m_prev) {
+            cort->m_prev->m_next = cort->m_next;
+        } else {
+            shard.head = cort->m_next;
+        }
+        if (cort->m_next) {
+            cort->m_next->m_prev = cort->m_prev;
+        }
+        cort->m_prev = cort->m_next = nullptr;
+    }
+
+    void CoroutineRegistry::Suspending(Coroutine *cort) {
+        if (!cort->m_backtraces) {
+            return;
+        }
+        void *frames[Coroutine::Backtraces::kFrames];
+        // leave out Suspending itself
+        int size = backtrace(frames, Coroutine::Backtraces::kFrames);
+        RegistryShard &shard = GetShards()[cort->m_shard];
+        Mutex::Lock lock(shard.mutex);
+        std::copy(frames + 1, frames + size, cort->m_backtraces->suspended);
+        cort->m_backtraces->suspendedSize = size - 1;
+    }
+
+    std::vector<CoroutineRegistry::Info> CoroutineRegistry::Collect(
+            const std::function<bool(const Coroutine *)> &filter) {
+        struct Raw {
+            Info info;
+            Scheduler *scheduler;
+            std::vector<void *> created;
+            std::vector<void *> suspended;
+        };
+        std::vector<Raw> raws;
+        uint64_t now = StateClockUS();
+        for (uint32_t i = 0; i < s_registry_shards; ++i) {
+            RegistryShard &shard = GetShards()[i];
+            Mutex::Lock lock(shard.mutex);
+            for (Coroutine *cort = shard.head; cort; cort = cort->m_next) {
+                if (!filter(cort)) {
+                    continue;
+                }
+                Raw raw;
+                raw.info.id = cort->m_id;
+                raw.info.state = cort->m_state;
+                raw.info.internal = cort->m_internal;
+                raw.info.thread = cort->m_lastThread;
+                raw.info.since = cort->m_stateSince;
+                raw.info.stateUs = now > raw.info.since ? now - raw.info.since : 0;
+                raw.scheduler = cort->m_scheduler;
+                if (cort->m_backtraces) {
+                    Coroutine::Backtraces &bt = *cort->m_backtraces;
+                    // the first frame is the constructor
+                    if (bt.createdSize > 1) {
+                        raw.created.assign(bt.created + 1, bt.created + bt.createdSize);
+                    }
+                    raw.suspended.assign(bt.suspended, bt.suspended + bt.suspendedSize);
+                }
+                raws.push_back(std::move(raw));
+            }
+        }
+
+        // symbols and names are looked up with no shard locked
+        std::vector<Info> infos;
+        for (auto &raw : raws) {
+            if (raw.scheduler) {
+                raw.info.scheduler = Scheduler::GetNameOf(raw.scheduler);
+            }
+            if (!raw.created.empty()) {
+                raw.info.created = Symbolize(raw.created);
+            }
+            // the frames of an earlier yield say nothing about a running one
+            if (!raw.suspended.empty() && raw.info.state != Coroutine::EXEC) {
+                raw.info.suspended = Symbolize(raw.suspended);
+            }
+            infos.push_back(std::move(raw.info));
+        }
+        std::sort(infos.begin(), infos.end(), [](const Info &a, const Info &b) {
+            return a.id < b.id;
+        });
+        return infos;
+    }
+
+    std::vector<CoroutineRegistry::Info> CoroutineRegistry::Dump() {
+        return Collect([](const Coroutine *) {
+            return true;
+        });
+    }
+
+    std::vector<CoroutineRegistry::Info> CoroutineRegistry::GetStuck(uint64_t exec_us) {
+        uint64_t now = StateClockUS();
+        return Collect([now, exec_us](const Coroutine *cort) {
+            uint64_t since = cort->m_stateSince;
+            return !cort->m_internal && cort->m_state == Coroutine::EXEC
+                   && now > since && now - since >= exec_us;
+        });
+    }
+
+    std::string CoroutineRegistry::DumpToString() {
+        static const char *states[] = {"INIT", "READY", "EXEC", "HOLD", "TERM", "EXCEPT"};
+        std::vector<Info> infos = Dump();
+        std::stringstream ss;
+        ss << infos.size() << " coroutines" << std::endl;
+        for (auto &info : infos) {
+            ss << "id=" << info.id << " " << states[info.state] << " for " << info.stateUs / 1000 << "ms"
+               << " thread=" << info.thread << " scheduler=" << info.scheduler
+               << (info.internal ? " internal" : "") << std::endl;
+            if (!info.created.empty()) {
+                ss << "    created at:" << std::endl << info.created;
+            }
+            if (!info.suspended.empty()) {
+                ss << "    suspended at:" << std::endl << info.suspended;
+            }
+        }
+        return ss.str();
+    }
+
 
     ////////////////////////////////////////////////////////////////////
     /// Coroutine
@@ -56,9 +303,12 @@ namespace mocker {
     Coroutine::Coroutine(task cb, uint32_t stacksize, bool use_caller)
             : m_id(++s_coroutine_id), m_cb(std::move(cb)) {
         ++s_coroutine_count;
-        m_stacksize = stacksize ? stacksize : g_coroutine_stack_size->getValue();
+        m_stacksize = stacksize ? stacksize : g_coroutine_stack_size.get();
 
-        m_stack = StackAllocator::Alloc(m_stacksize);
+        if (g_coroutine_stack_numa_local.get()) {
+            m_stackNode = Thread::GetCurrentNumaNode();
+        }
+        m_stack = StackAllocator::Alloc(m_stacksize, m_stackNode);
         if (getcontext(&m_ctx)) {
             MOCKER_ASSERT2(false, "getcontext");
         }
@@ -71,7 +321,16 @@ namespace mocker {
             makecontext(&m_ctx, &Coroutine::MainFunc, 0);
         } else {
             makecontext(&m_ctx, &Coroutine::CallerMainFunc, 0);
+            // runs the scheduler loop of the caller thread
+            m_internal = true;
+        }
+
+        if (g_coroutine_debug_backtrace.get()) {
+            m_backtraces.reset(new Backtraces);
+            m_backtraces->createdSize = backtrace(m_backtraces->created, Backtraces::kFrames);
         }
+        m_stateSince = StateClockUS();
+        CoroutineRegistry::Register(this);
 
         MOCKER_LOG_DEBUG(g_logger) << "Coroutine::Coroutine id=" << m_id;
     }
@@ -79,9 +338,10 @@ namespace mocker {
     Coroutine::~Coroutine() {
         --s_coroutine_count;
         if (m_stack) {
+            CoroutineRegistry::Unregister(this);
             MOCKER_ASSERT2(m_state == TERM || m_state == INIT || m_state == EXCEPT,
                            "m_state " + std::to_string(m_state));
-            StackAllocator::Dealloc(m_stack, m_stacksize);
+            StackAllocator::Dealloc(m_stack, m_stacksize, m_stackNode);
         } else {
             MOCKER_ASSERT(!m_cb);
             MOCKER_ASSERT(m_state == EXEC);
@@ -98,7 +358,7 @@ namespace mocker {
     void Coroutine::reset(Coroutine::task cb) {
         MOCKER_ASSERT(m_stack);
         MOCKER_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
-        m_cb = cb;
+        m_cb = std::move(cb);
         if (getcontext(&m_ctx)) {
             MOCKER_ASSERT2(false, "getcontext");
         }
@@ -109,15 +369,16 @@ namespace mocker {
 
         makecontext(&m_ctx, &Coroutine::MainFunc, 0);
         m_state = INIT;
+        m_stateSince = StateClockUS();
     }
 
-    void Coroutine::swapIn() {
+    Coroutine::State Coroutine::swapIn() {
         SetCurrent(this);
-        MOCKER_ASSERT(m_state != EXEC);
-        m_state = EXEC;
+        setExec();
         if (swapcontext(&Scheduler::GetMainCoroutine()->m_ctx, &m_ctx)) {
             MOCKER_ASSERT2(false, "swapcontext")
         }
+        return applyNextState();
     }
 
     void Coroutine::swapOut() {
@@ -127,13 +388,13 @@ namespace mocker {
         }
     }
 
-    void Coroutine::call() {
+    Coroutine::State Coroutine::call() {
         SetCurrent(this);
-        MOCKER_ASSERT(m_state != EXEC);
-        m_state = EXEC;
+        setExec();
         if (swapcontext(&t_threadCoroutine->m_ctx, &m_ctx)) {
             MOCKER_ASSERT2(false, "swapcontext")
         }
+        return applyNextState();
     }
 
     void Coroutine::back() {
@@ -143,6 +404,23 @@ namespace mocker {
         }
     }
 
+    Coroutine::State Coroutine::applyNextState() {
+        State next = m_nextState;
+        m_nextState = HOLD;
+        m_stateSince = StateClockUS();
+        // last: once it leaves EXEC another worker may swap it in and yield again
+        m_state = next;
+        return next;
+    }
+
+    void Coroutine::setExec() {
+        MOCKER_ASSERT(m_state != EXEC);
+        m_state = EXEC;
+        m_stateSince = StateClockUS();
+        m_lastThread = CurrentThreadId();
+        m_scheduler = Scheduler::GetCurrent();
+    }
+
     void Coroutine::SetCurrent(Coroutine *cort) {
         t_coroutine = cort;
     }
@@ -158,14 +436,19 @@ namespace mocker {
     }
 
     void Coroutine::Yield() {
-        Coroutine::ptr cur = GetCurrent();
-        cur->m_state = READY;
+        // whoever swapped it in holds a reference, no need to count one more
+        Coroutine *cur = t_coroutine;
+        MOCKER_ASSERT(cur);
+        cur->m_nextState = READY;
+        CoroutineRegistry::Suspending(cur);
         cur->swapOut();
     }
 
     void Coroutine::Sleep() {
-        Coroutine::ptr cur = GetCurrent();
-        cur->m_state = HOLD;
+        Coroutine *cur = t_coroutine;
+        MOCKER_ASSERT(cur);
+        cur->m_nextState = HOLD;
+        CoroutineRegistry::Suspending(cur);
         cur->swapOut();
     }
 
@@ -174,30 +457,34 @@ namespace mocker {
     }
 
     void Coroutine::MainFunc() {
-        Coroutine::ptr cur = GetCurrent();
+        // a raw pointer, a reference on this stack would never be released
+        Coroutine *cur = t_coroutine;
         MOCKER_ASSERT(cur);
 
+        State end = TERM;
         try {
             cur->m_cb();
             cur->m_cb = nullptr;
-            cur->m_state = TERM;
         } catch (std::exception &ex) {
-            cur->m_state = EXCEPT;
+            end = EXCEPT;
             MOCKER_LOG_ERROR(g_logger) << "Coroutine Exception: " << ex.what()
                                        << "\n" << BacktraceToString(100);
         } catch (...) {
-            cur->m_state = EXCEPT;
+            end = EXCEPT;
             MOCKER_LOG_ERROR(g_logger) << "Coroutine Exception: "
                                        << "\n" << BacktraceToString(100);
         }
 
+        // in the coroutine, a destructor may still use it
+        cur->m_locals.clear();
+        // published by applyNextState once this stack is left
+        cur->m_nextState = end;
+
         /*
          * It will not cause OOM because ~Coroutine will deallocate the
          * whole coroutine stack.
          */
-        auto raw_ptr = cur.get();
-        cur.reset();
-        raw_ptr->swapOut();
+        cur->swapOut();
 
         /*
          * Here will cause a share_ptr cycle reference. Because the stack
@@ -210,30 +497,34 @@ namespace mocker {
     }
 
     void Coroutine::CallerMainFunc() {
-        Coroutine::ptr cur = GetCurrent();
+        // a raw pointer, a reference on this stack would never be released
+        Coroutine *cur = t_coroutine;
         MOCKER_ASSERT(cur);
 
+        State end = TERM;
         try {
             cur->m_cb();
             cur->m_cb = nullptr;
-            cur->m_state = TERM;
         } catch (std::exception &ex) {
-            cur->m_state = EXCEPT;
+            end = EXCEPT;
             MOCKER_LOG_ERROR(g_logger) << "Coroutine Exception: " << ex.what()
                                        << "\n" << BacktraceToString(100);
         } catch (...) {
-            cur->m_state = EXCEPT;
+            end = EXCEPT;
             MOCKER_LOG_ERROR(g_logger) << "Coroutine Exception: "
                                        << "\n" << BacktraceToString(100);
         }
 
+        // in the coroutine, a destructor may still use it
+        cur->m_locals.clear();
+        // published by applyNextState once this stack is left
+        cur->m_nextState = end;
+
         /*
          * It will not cause OOM because ~Coroutine will deallocate the
          * whole coroutine stack.
          */
-        auto raw_ptr = cur.get();
-        cur.reset();
-        raw_ptr->back();
+        cur->back();
 
         /*
          * Here will cause a share_ptr cycle reference. Because the stack
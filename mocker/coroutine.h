@@ -6,13 +6,62 @@
 #define MOCKER_COROUTINE_H
 
 #include <memory>
+#include <atomic>
 #include <ucontext.h>
 #include <functional>
+#include <string>
+#include <vector>
 
 #include <mocker/mutex.h>
 
 namespace mocker {
+
+    class Scheduler;
+
+    /**
+     * Slots of coroutine-local values, indexed by the slot a CoroutineLocal
+     * got from Register(). Each coroutine has its own, the first ones inline;
+     * outside a coroutine the thread has one.
+     */
+    class CoroutineLocals {
+    public:
+        static const size_t kInlineSlots = 8;
+        static const size_t kMaxSlots = 1024;
+
+        CoroutineLocals() = default;
+        // runs the destructors of the values still set
+        ~CoroutineLocals();
+
+        CoroutineLocals(const CoroutineLocals &) = delete;
+        CoroutineLocals &operator=(const CoroutineLocals &) = delete;
+
+        void *&at(size_t slot) {
+            if (slot < kInlineSlots) {
+                return m_inline[slot];
+            }
+            if (slot - kInlineSlots >= m_more.size()) {
+                m_more.resize(slot - kInlineSlots + 1, nullptr);
+            }
+            return m_more[slot - kInlineSlots];
+        }
+
+        // destroy every value, a destructor may set another one
+        void clear();
+
+        // a new slot, values in it are freed with destroy
+        static size_t Register(void (*destroy)(void *));
+
+        // of the running coroutine, of the thread outside of one
+        static CoroutineLocals &Current();
+
+    private:
+        void *m_inline[kInlineSlots] = {nullptr};
+        std::vector<void *> m_more;
+    };
+
     class Coroutine : public std::enable_shared_from_this<Coroutine> {
+    friend class CoroutineLocals;
+    friend class CoroutineRegistry;
     public:
         typedef std::shared_ptr<Coroutine> ptr;
         typedef std::function<void()> task;
@@ -35,18 +84,27 @@ namespace mocker {
 
         // reset state from INIT, TERM
         void reset(task cb);
-        // swap to other thread's current
-        void swapIn();
+        // swap to other thread's current, returns the state it left EXEC for
+        State swapIn();
         // swap from other thread's current
         void swapOut();
-        // swap to current
-        void call();
+        // swap to current, returns the state it left EXEC for
+        State call();
         // swap from current
         void back();
 
         uint64_t getId() const { return m_id; }
         State getState() const { return m_state; }
         void setState(State state) { m_state = state; }
+        CoroutineLocals &getLocals() { return m_locals; }
+        // scheduling class a Scheduler queues it in when woken, -1 for the default
+        int getSchedClass() const { return m_schedClass; }
+        void setSchedClass(int sched_class) { m_schedClass = sched_class; }
+        // thread it was last swapped in on, 0 before that
+        pid_t getLastThread() const { return m_lastThread; }
+        // a scheduler's own idle or run loop, never reported as stuck
+        bool isInternal() const { return m_internal; }
+        void setInternal(bool internal) { m_internal = internal; }
     public:
         // set current coroutine
         static void SetCurrent(Coroutine* cort);
@@ -64,15 +122,142 @@ namespace mocker {
         static void CallerMainFunc();
 
         static uint64_t GetCoroutineId();
+    private:
+        /*
+         * Apply the state requested by Yield/Sleep/MainFunc once the context
+         * is saved and return it. Once published another worker may own the
+         * coroutine, so the caller must decide from the returned value only.
+         */
+        State applyNextState();
+
+        void setExec();
+
     private:
         uint64_t m_id = 0;
         uint32_t m_stacksize = 0;
-        State m_state = INIT;
+        // NUMA node the stack was placed on, -1 for malloc
+        int m_stackNode = -1;
+        /*
+         * Other threads may schedule this coroutine while it is still
+         * swapping out. It stays EXEC until its context has been saved,
+         * so the scheduler will not swap it in on two stacks at once.
+         */
+        std::atomic<State> m_state{INIT};
+        State m_nextState = HOLD;
+        int m_schedClass = -1;
+        bool m_internal = false;
+
+        // read by CoroutineRegistry from other threads
+        std::atomic<pid_t> m_lastThread{0};
+        std::atomic<Scheduler *> m_scheduler{nullptr};
+        std::atomic<uint64_t> m_stateSince{0};
+
+        // links of its registry shard, guarded by the shard lock
+        Coroutine *m_prev = nullptr;
+        Coroutine *m_next = nullptr;
+        uint32_t m_shard = 0;
+        struct Backtraces;
+        // with coroutine.debug_backtrace only
+        std::unique_ptr<Backtraces> m_backtraces;
 
         ucontext_t m_ctx;
         void* m_stack = nullptr;
 
         task m_cb;
+        // cleared when the task ends, a reused coroutine starts empty
+        CoroutineLocals m_locals;
+    };
+
+    /**
+     * Every coroutine with a stack, for finding out what a hung process is
+     * doing. Coroutines are linked into one of a few shards, picked by the
+     * creating thread, so threads creating coroutines rarely share a lock.
+     * With coroutine.debug_backtrace, the frames where a coroutine was
+     * created and where it last yielded are kept too; that costs a
+     * backtrace() each time, leave it off unless looking for a hang.
+     */
+    class CoroutineRegistry {
+    friend class Coroutine;
+    public:
+        struct Info {
+            uint64_t id = 0;
+            Coroutine::State state = Coroutine::INIT;
+            bool internal = false;
+            // last ran on, 0 if never
+            pid_t thread = 0;
+            // empty if it never ran in one, or the scheduler is gone
+            std::string scheduler;
+            // monotonic us of the last state change, and the time since
+            uint64_t since = 0;
+            uint64_t stateUs = 0;
+            // with coroutine.debug_backtrace only
+            std::string created;
+            std::string suspended;
+        };
+
+        static std::vector<Info> Dump();
+
+        // coroutines in EXEC for exec_us or longer, internal ones left out
+        static std::vector<Info> GetStuck(uint64_t exec_us);
+
+        // one line per coroutine, and the backtraces under it
+        static std::string DumpToString();
+
+    private:
+        static void Register(Coroutine *cort);
+
+        static void Unregister(Coroutine *cort);
+
+        // with coroutine.debug_backtrace, remember where it yields
+        static void Suspending(Coroutine *cort);
+
+        static std::vector<Info> Collect(const std::function<bool(const Coroutine *)> &filter);
+    };
+
+    /**
+     * A T per coroutine, it follows the coroutine to whichever thread runs
+     * it. Outside a coroutine, and on the thread's own main coroutine, the
+     * value belongs to the thread instead. get() creates it on first use.
+     * Slots are never given back: define these static.
+     */
+    template<class T>
+    class CoroutineLocal {
+    public:
+        CoroutineLocal() : m_slot(CoroutineLocals::Register(&Destroy)) {}
+
+        CoroutineLocal(const CoroutineLocal &) = delete;
+        CoroutineLocal &operator=(const CoroutineLocal &) = delete;
+
+        T &get() {
+            void *&value = CoroutineLocals::Current().at(m_slot);
+            if (!value) {
+                value = new T();
+            }
+            return *(T *) value;
+        }
+
+        void set(T value) { get() = std::move(value); }
+
+        // whether the current coroutine has a value yet
+        bool has() const { return CoroutineLocals::Current().at(m_slot) != nullptr; }
+
+        void reset() {
+            void *&value = CoroutineLocals::Current().at(m_slot);
+            Destroy(value);
+            value = nullptr;
+        }
+
+        T &operator*() { return get(); }
+
+        T *operator->() { return &get(); }
+
+    private:
+        static void Destroy(void *value) {
+            delete (T *) value;
+        }
+
+    private:
+        size_t m_slot;
     };
 }
 
@@ -0,0 +1,83 @@
+#ifndef MOCKER_FD_MANAGER_H
+#define MOCKER_FD_MANAGER_H
+
+#include <memory>
+#include <vector>
+
+#include <mocker/mutex.h>
+#include <mocker/singleton.h>
+
+namespace mocker {
+
+    /**
+     * What the hook layer knows about an fd: whether it is a socket, who
+     * asked for O_NONBLOCK, and the SO_RCVTIMEO/SO_SNDTIMEO timeouts.
+     */
+    class FdCtx : public std::enable_shared_from_this<FdCtx> {
+    public:
+        typedef std::shared_ptr<FdCtx> ptr;
+
+        explicit FdCtx(int fd);
+
+        ~FdCtx();
+
+        bool isInit() const { return m_isInit; }
+
+        bool isSocket() const { return m_isSocket; }
+
+        bool isClose() const { return m_isClosed; }
+
+        // O_NONBLOCK set by the user, hooked calls then never yield
+        void setUserNonblock(bool v) { m_userNonblock = v; }
+
+        bool getUserNonblock() const { return m_userNonblock; }
+
+        // O_NONBLOCK set by the hook layer on every socket
+        void setSysNonblock(bool v) { m_sysNonblock = v; }
+
+        bool getSysNonblock() const { return m_sysNonblock; }
+
+        /**
+         * @param type SO_RCVTIMEO or SO_SNDTIMEO
+         * @param v timeout in ms, ~0ull means no timeout
+         */
+        void setTimeout(int type, uint64_t v);
+
+        uint64_t getTimeout(int type);
+
+    private:
+        bool init();
+
+    private:
+        bool m_isInit: 1;
+        bool m_isSocket: 1;
+        bool m_sysNonblock: 1;
+        bool m_userNonblock: 1;
+        bool m_isClosed: 1;
+        int m_fd;
+        uint64_t m_recvTimeout;
+        uint64_t m_sendTimeout;
+    };
+
+
+    class FdManager {
+    public:
+        typedef RWMutex RWMutexType;
+
+        FdManager();
+
+        // auto_create adds the fd if it is not managed yet
+        FdCtx::ptr get(int fd, bool auto_create = false);
+
+        void del(int fd);
+
+    private:
+        RWMutexType m_mutex;
+        std::vector<FdCtx::ptr> m_datas;
+    };
+
+    typedef Singleton<FdManager> FdMgr;
+
+}
+
+#endif //MOCKER_FD_MANAGER_H
@@ -0,0 +1,463 @@
+#include <dlfcn.h>
+#include <cstdarg>
+#include <cerrno>
+#include <cstring>
+
+#include <mocker/hook.h>
+#include <mocker/config.h>
+#include <mocker/coroutine.h>
+#include <mocker/fd_manager.h>
+#include <mocker/iomanager.h>
+#include <mocker/log.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    static thread_local bool t_hook_enable = false;
+
+    static ConfigVar<int>::ptr g_tcp_connect_timeout =
+            Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout in ms");
+
+#define HOOK_FUN(XX) \
+    XX(sleep) \
+    XX(usleep) \
+    XX(nanosleep) \
+    XX(socket) \
+    XX(connect) \
+    XX(accept) \
+    XX(read) \
+    XX(readv) \
+    XX(recv) \
+    XX(recvfrom) \
+    XX(recvmsg) \
+    XX(write) \
+    XX(writev) \
+    XX(send) \
+    XX(sendto) \
+    XX(sendmsg) \
+    XX(close) \
+    XX(fcntl) \
+    XX(ioctl) \
+    XX(getsockopt) \
+    XX(setsockopt)
+
+    static void hook_init() {
+        static bool is_inited = false;
+        if (is_inited) {
+            return;
+        }
+#define XX(name) name ## _f = (name ## _fun) dlsym(RTLD_NEXT, #name);
+        HOOK_FUN(XX);
+#undef XX
+        is_inited = true;
+    }
+
+    static uint64_t s_connect_timeout = -1;
+
+    struct HookIniter {
+        HookIniter() {
+            hook_init();
+            s_connect_timeout = g_tcp_connect_timeout->getValue();
+
+            g_tcp_connect_timeout->addListener([](const int &old_value, const int &new_value) {
+                MOCKER_LOG_INFO(g_logger) << "tcp connect timeout changed from "
+                                          << old_value << " to " << new_value;
+                s_connect_timeout = new_value;
+            });
+        }
+    };
+
+    // resolve the original functions before main()
+    static HookIniter s_hook_initer;
+
+    bool is_hook_enable() {
+        return t_hook_enable;
+    }
+
+    void set_hook_enable(bool flag) {
+        t_hook_enable = flag;
+    }
+
+    // hooked calls may only yield inside a coroutine driven by an IOManager
+    static bool can_yield() {
+        return t_hook_enable
+               && IOManager::GetCurrent()
+               && Coroutine::GetCoroutineId() != 0;
+    }
+}
+
+struct timer_info {
+    int cancelled = 0;
+};
+
+/**
+ * Run an I/O call on a socket. On EAGAIN the coroutine waits for event on
+ * the IOManager, bounded by the SO_RCVTIMEO/SO_SNDTIMEO of the fd, and
+ * then retries.
+ */
+template<typename OriginFun, typename ... Args>
+static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
+                     uint32_t event, int timeout_so, Args &&... args) {
+    if (!mocker::can_yield()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(fd);
+    if (!ctx) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    if (ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!ctx->isSocket() || ctx->getUserNonblock()) {
+        return fun(fd, std::forward<Args>(args)...);
+    }
+
+    uint64_t to = ctx->getTimeout(timeout_so);
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+
+    retry:
+    ssize_t n = fun(fd, std::forward<Args>(args)...);
+    while (n == -1 && errno == EINTR) {
+        n = fun(fd, std::forward<Args>(args)...);
+    }
+
+    if (n == -1 && errno == EAGAIN) {
+        mocker::IOManager *iom = mocker::IOManager::GetCurrent();
+        mocker::Timer::ptr timer;
+        std::weak_ptr<timer_info> winfo(tinfo);
+
+        if (to != ~0ull) {
+            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
+                auto t = winfo.lock();
+                if (!t || t->cancelled) {
+                    return;
+                }
+                // the kernel reports an expired SO_RCVTIMEO/SO_SNDTIMEO as EAGAIN
+                t->cancelled = EAGAIN;
+                iom->cancelEvent(fd, (mocker::IOManager::Event) (event));
+            }, winfo);
+        }
+
+        int rt = iom->addEvent(fd, (mocker::IOManager::Event) (event));
+        if (rt) {
+            MOCKER_LOG_ERROR(mocker::g_logger) << hook_fun_name << " addEvent("
+                                               << fd << ", " << event << ")";
+            if (timer) {
+                timer->cancel();
+            }
+            return -1;
+        } else {
+            mocker::Coroutine::Sleep();
+            if (timer) {
+                timer->cancel();
+            }
+            if (tinfo->cancelled) {
+                errno = tinfo->cancelled;
+                return -1;
+            }
+            goto retry;
+        }
+    }
+
+    return n;
+}
+
+static void sleep_for_ms(uint64_t ms) {
+    mocker::Coroutine::ptr cort = mocker::Coroutine::GetCurrent();
+    mocker::IOManager *iom = mocker::IOManager::GetCurrent();
+    iom->addTimer(ms, [iom, cort]() {
+        iom->schedule(cort);
+    });
+    mocker::Coroutine::Sleep();
+}
+
+extern "C" {
+#define XX(name) name ## _fun name ## _f = nullptr;
+HOOK_FUN(XX);
+#undef XX
+
+unsigned int sleep(unsigned int seconds) {
+    if (!mocker::can_yield()) {
+        return sleep_f(seconds);
+    }
+    sleep_for_ms(seconds * 1000ull);
+    return 0;
+}
+
+int usleep(useconds_t usec) {
+    if (!mocker::can_yield()) {
+        return usleep_f(usec);
+    }
+    sleep_for_ms(usec / 1000);
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    if (!mocker::can_yield()) {
+        return nanosleep_f(req, rem);
+    }
+    sleep_for_ms(req->tv_sec * 1000ull + req->tv_nsec / 1000000);
+    return 0;
+}
+
+int socket(int domain, int type, int protocol) {
+    if (!mocker::is_hook_enable()) {
+        return socket_f(domain, type, protocol);
+    }
+    int fd = socket_f(domain, type, protocol);
+    if (fd == -1) {
+        return fd;
+    }
+    mocker::FdMgr::GetInstance()->get(fd, true);
+    return fd;
+}
+
+int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen, uint64_t timeout_ms) {
+    if (!mocker::can_yield()) {
+        return connect_f(fd, addr, addrlen);
+    }
+    mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(fd);
+    if (!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!ctx->isSocket() || ctx->getUserNonblock()) {
+        return connect_f(fd, addr, addrlen);
+    }
+
+    int n = connect_f(fd, addr, addrlen);
+    if (n == 0) {
+        return 0;
+    } else if (n != -1 || errno != EINPROGRESS) {
+        return n;
+    }
+
+    mocker::IOManager *iom = mocker::IOManager::GetCurrent();
+    mocker::Timer::ptr timer;
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+    std::weak_ptr<timer_info> winfo(tinfo);
+
+    if (timeout_ms != ~0ull) {
+        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+            auto t = winfo.lock();
+            if (!t || t->cancelled) {
+                return;
+            }
+            t->cancelled = ETIMEDOUT;
+            iom->cancelEvent(fd, mocker::IOManager::WRITE);
+        }, winfo);
+    }
+
+    int rt = iom->addEvent(fd, mocker::IOManager::WRITE);
+    if (rt == 0) {
+        mocker::Coroutine::Sleep();
+        if (timer) {
+            timer->cancel();
+        }
+        if (tinfo->cancelled) {
+            errno = tinfo->cancelled;
+            return -1;
+        }
+    } else {
+        if (timer) {
+            timer->cancel();
+        }
+        MOCKER_LOG_ERROR(mocker::g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if (-1 == getsockopt_f(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        return -1;
+    }
+    if (!error) {
+        return 0;
+    } else {
+        errno = error;
+        return -1;
+    }
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    return connect_with_timeout(sockfd, addr, addrlen, mocker::s_connect_timeout);
+}
+
+int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
+    int fd = (int) do_io(s, accept_f, "accept", mocker::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if (fd >= 0 && mocker::is_hook_enable()) {
+        mocker::FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    return do_io(fd, read_f, "read", mocker::IOManager::READ, SO_RCVTIMEO, buf, count);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    return do_io(fd, readv_f, "readv", mocker::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    return do_io(sockfd, recv_f, "recv", mocker::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
+    return do_io(sockfd, recvfrom_f, "recvfrom", mocker::IOManager::READ, SO_RCVTIMEO,
+                 buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    return do_io(sockfd, recvmsg_f, "recvmsg", mocker::IOManager::READ, SO_RCVTIMEO, msg, flags);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    return do_io(fd, write_f, "write", mocker::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    return do_io(fd, writev_f, "writev", mocker::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+}
+
+ssize_t send(int s, const void *msg, size_t len, int flags) {
+    return do_io(s, send_f, "send", mocker::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+}
+
+ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    return do_io(s, sendto_f, "sendto", mocker::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+}
+
+ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+    return do_io(s, sendmsg_f, "sendmsg", mocker::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+}
+
+int close(int fd) {
+    mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(fd);
+    if (ctx) {
+        auto iom = mocker::IOManager::GetCurrent();
+        if (iom && mocker::is_hook_enable()) {
+            iom->cancelAll(fd);
+        }
+        // dropped even unhooked, the fd number may come back as a plain file
+        mocker::FdMgr::GetInstance()->del(fd);
+    }
+    return close_f(fd);
+}
+
+int fcntl(int fd, int cmd, ... /* arg */ ) {
+    va_list va;
+    va_start(va, cmd);
+    switch (cmd) {
+        case F_SETFL: {
+            int arg = va_arg(va, int);
+            va_end(va);
+            mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(fd);
+            if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                return fcntl_f(fd, cmd, arg);
+            }
+            // remember what the user wants, the socket itself stays non-blocking
+            ctx->setUserNonblock(arg & O_NONBLOCK);
+            if (ctx->getSysNonblock()) {
+                arg |= O_NONBLOCK;
+            } else {
+                arg &= ~O_NONBLOCK;
+            }
+            return fcntl_f(fd, cmd, arg);
+        }
+        case F_GETFL: {
+            va_end(va);
+            int arg = fcntl_f(fd, cmd);
+            mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(fd);
+            if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                return arg;
+            }
+            if (ctx->getUserNonblock()) {
+                return arg | O_NONBLOCK;
+            } else {
+                return arg & ~O_NONBLOCK;
+            }
+        }
+        case F_DUPFD:
+        case F_DUPFD_CLOEXEC:
+        case F_SETFD:
+        case F_SETOWN:
+        case F_SETSIG:
+        case F_SETLEASE:
+        case F_NOTIFY:
+        case F_SETPIPE_SZ: {
+            int arg = va_arg(va, int);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        case F_GETFD:
+        case F_GETOWN:
+        case F_GETSIG:
+        case F_GETLEASE:
+        case F_GETPIPE_SZ: {
+            va_end(va);
+            return fcntl_f(fd, cmd);
+        }
+        case F_SETLK:
+        case F_SETLKW:
+        case F_GETLK: {
+            struct flock *arg = va_arg(va, struct flock*);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        case F_GETOWN_EX:
+        case F_SETOWN_EX: {
+            struct f_owner_exlock *arg = va_arg(va, struct f_owner_exlock*);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+        default: {
+            unsigned long arg = va_arg(va, unsigned long);
+            va_end(va);
+            return fcntl_f(fd, cmd, arg);
+        }
+    }
+}
+
+int ioctl(int d, unsigned long int request, ...) {
+    va_list va;
+    va_start(va, request);
+    void *arg = va_arg(va, void*);
+    va_end(va);
+
+    if (FIONBIO == request) {
+        bool user_nonblock = !!*(int *) arg;
+        mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(d);
+        if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+            return ioctl_f(d, request, arg);
+        }
+        ctx->setUserNonblock(user_nonblock);
+        // keep the socket non-blocking for the hook layer
+        int on = 1;
+        return ioctl_f(d, request, &on);
+    }
+    return ioctl_f(d, request, arg);
+}
+
+int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    return getsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    if (level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)) {
+        mocker::FdCtx::ptr ctx = mocker::FdMgr::GetInstance()->get(sockfd);
+        if (ctx) {
+            const auto *v = (const timeval *) optval;
+            uint64_t ms = v->tv_sec * 1000ull + v->tv_usec / 1000;
+            // zero means no timeout, as for the socket option itself
+            ctx->setTimeout(optname, ms ? ms : ~0ull);
+        }
+    }
+    return setsockopt_f(sockfd, level, optname, optval, optlen);
+}
+
+}
@@ -0,0 +1,795 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <mocker/iomanager.h>
+#include <mocker/config.h>
+#include <mocker/hook.h>
+#include <mocker/log.h>
+#include <mocker/macro.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    static ConfigVar<bool>::ptr g_iomanager_io_uring =
+            Config::Lookup<bool>("iomanager.io_uring", false,
+                                 "use io_uring when the kernel supports it");
+
+    static ConfigVar<uint32_t>::ptr g_iomanager_io_uring_entries =
+            Config::Lookup<uint32_t>("iomanager.io_uring_entries", 256,
+                                     "io_uring submission queue entries");
+
+    static ConfigVar<bool>::ptr g_iomanager_hook =
+            Config::Lookup<bool>("iomanager.hook", true,
+                                 "hook blocking syscalls in IOManager threads");
+
+    ////////////////////////////////////////////////////////////////////
+    /// IOManager::Uring
+    ////////////////////////////////////////////////////////////////////
+    struct IOManager::Uring {
+        typedef Mutex MutexType;
+
+        // one in-flight request, lives on the stack of the waiting coroutine
+        struct Completion {
+            Coroutine::ptr coroutine;
+            int32_t res = 0;
+        };
+
+        int ringFd = -1;
+        int eventFd = -1;
+        unsigned entries = 0;
+
+        unsigned *sqHead = nullptr;
+        unsigned *sqTail = nullptr;
+        unsigned *sqMask = nullptr;
+        unsigned *sqArray = nullptr;
+        io_uring_sqe *sqes = nullptr;
+
+        unsigned *cqHead = nullptr;
+        unsigned *cqTail = nullptr;
+        unsigned *cqMask = nullptr;
+        io_uring_cqe *cqes = nullptr;
+
+        void *sqRing = MAP_FAILED;
+        size_t sqRingSize = 0;
+        void *cqRing = MAP_FAILED;
+        size_t cqRingSize = 0;
+        size_t sqesSize = 0;
+
+        MutexType sqMutex;
+        MutexType cqMutex;
+        // with sqMutex held: a flush task is queued, coroutines wait for room
+        bool flushScheduled = false;
+        std::vector<Coroutine::ptr> sqWaiters;
+
+        bool init(unsigned n);
+
+        /*
+         * With sqMutex held. Entries the kernel refuses for good are taken
+         * back and their coroutines go to failed with the error, a busy
+         * ring keeps them for the next flush.
+         */
+        void submitNoLock(std::vector<Coroutine::ptr> &failed);
+
+        bool fullNoLock() const {
+            return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries;
+        }
+
+        ~Uring();
+    };
+
+    bool IOManager::Uring::init(unsigned n) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = (int) syscall(__NR_io_uring_setup, n, &params);
+        if (ringFd < 0) {
+            MOCKER_LOG_WARN(g_logger) << "io_uring_setup fail, errno=" << errno
+                                      << " errstr=" << strerror(errno);
+            return false;
+        }
+
+        // NODROP keeps completions when the CQ overflows, RW_CUR_POS allows offset -1
+        if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+            MOCKER_LOG_WARN(g_logger) << "io_uring features not supported, features=" << params.features;
+            return false;
+        }
+
+        entries = params.sq_entries;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+
+        if (single_mmap) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                return false;
+            }
+        }
+
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes_ptr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes = (io_uring_sqe *) sqes_ptr;
+
+        char *sq = (char *) sqRing;
+        sqHead = (unsigned *) (sq + params.sq_off.head);
+        sqTail = (unsigned *) (sq + params.sq_off.tail);
+        sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *) (sq + params.sq_off.array);
+
+        char *cq = (char *) cqRing;
+        cqHead = (unsigned *) (cq + params.cq_off.head);
+        cqTail = (unsigned *) (cq + params.cq_off.tail);
+        cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0) {
+            return false;
+        }
+
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1)) {
+            MOCKER_LOG_WARN(g_logger) << "io_uring_register eventfd fail, errno=" << errno
+                                      << " errstr=" << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    void IOManager::Uring::submitNoLock(std::vector<Coroutine::ptr> &failed) {
+        unsigned tail = *sqTail;
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            return;
+        }
+        long rt;
+        do {
+            rt = syscall(__NR_io_uring_enter, ringFd, tail - head, 0, 0, nullptr, 0);
+        } while (rt < 0 && errno == EINTR);
+        if (rt >= 0 || errno == EAGAIN || errno == EBUSY) {
+            return;
+        }
+
+        int error = errno;
+        MOCKER_LOG_ERROR(g_logger) << "io_uring_enter fail, errno=" << error
+                                   << " errstr=" << strerror(error);
+        // the kernel took none of them, nothing else writes the tail
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        for (unsigned i = head; i != tail; ++i) {
+            auto *comp = (Completion *) (uintptr_t) sqes[i & *sqMask].user_data;
+            comp->res = -error;
+            failed.push_back(std::move(comp->coroutine));
+        }
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+    }
+
+    IOManager::Uring::~Uring() {
+        if (sqes) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (eventFd >= 0) {
+            close_f(eventFd);
+        }
+        if (ringFd >= 0) {
+            close_f(ringFd);
+        }
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// IOManager::FdContext
+    ////////////////////////////////////////////////////////////////////
+    IOManager::FdContext::EventContext &IOManager::FdContext::getContext(IOManager::Event event) {
+        switch (event) {
+            case IOManager::READ:
+                return read;
+            case IOManager::WRITE:
+                return write;
+            default:
+                MOCKER_ASSERT2(false, "getContext");
+        }
+        throw std::invalid_argument("getContext invalid event");
+    }
+
+    void IOManager::FdContext::resetContext(IOManager::FdContext::EventContext &ctx) {
+        ctx.scheduler = nullptr;
+        ctx.coroutine.reset();
+        ctx.cb = nullptr;
+    }
+
+    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+        MOCKER_ASSERT(events & event);
+        events = (Event) (events & ~event);
+        EventContext &ctx = getContext(event);
+        if (ctx.cb) {
+            ctx.scheduler->schedule(&ctx.cb);
+        } else {
+            ctx.scheduler->schedule(&ctx.coroutine);
+        }
+        ctx.scheduler = nullptr;
+    }
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// IOManager
+    ////////////////////////////////////////////////////////////////////
+    IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, bool use_uring)
+            : Scheduler(threads, use_caller, name), m_mutex("iomanager") {
+        m_epfd = epoll_create(5000);
+        MOCKER_ASSERT(m_epfd > 0);
+
+        int rt = pipe(m_tickleFds);
+        MOCKER_ASSERT(!rt);
+
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = m_tickleFds;
+
+        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+        MOCKER_ASSERT(!rt);
+
+        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+        MOCKER_ASSERT(!rt);
+
+        if (use_uring && g_iomanager_io_uring->getValue()) {
+            m_uring = new Uring;
+            if (m_uring->init(g_iomanager_io_uring_entries->getValue())) {
+                event.events = EPOLLIN | EPOLLET;
+                event.data.ptr = m_uring;
+                rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uring->eventFd, &event);
+                MOCKER_ASSERT(!rt);
+            } else {
+                MOCKER_LOG_WARN(g_logger) << "io_uring unavailable, IOManager " << name
+                                          << " falls back to epoll";
+                delete m_uring;
+                m_uring = nullptr;
+            }
+        }
+
+        contextResize(32);
+
+        m_hookEnable = g_iomanager_hook->getValue();
+        start();
+    }
+
+    IOManager::~IOManager() {
+        stop();
+        close_f(m_epfd);
+        close_f(m_tickleFds[0]);
+        close_f(m_tickleFds[1]);
+
+        for (auto &ctx : m_fdContexts) {
+            delete ctx;
+        }
+
+        delete m_uring;
+    }
+
+    void IOManager::contextResize(size_t size) {
+        m_fdContexts.resize(size);
+
+        for (size_t i = 0; i < m_fdContexts.size(); ++i) {
+            if (!m_fdContexts[i]) {
+                m_fdContexts[i] = new FdContext;
+                m_fdContexts[i]->fd = (int) i;
+            }
+        }
+    }
+
+    int IOManager::addEvent(int fd, IOManager::Event event, Coroutine::task cb) {
+        FdContext *fd_ctx = nullptr;
+        RWMutexType::ReadLock lock(m_mutex);
+        if ((int) m_fdContexts.size() > fd) {
+            fd_ctx = m_fdContexts[fd];
+            lock.unlock();
+        } else {
+            lock.unlock();
+            RWMutexType::WriteLock lock2(m_mutex);
+            contextResize(fd * 1.5);
+            fd_ctx = m_fdContexts[fd];
+        }
+
+        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        if (fd_ctx->events & event) {
+            MOCKER_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
+                                       << " event=" << event
+                                       << " fd_ctx.event=" << fd_ctx->events;
+            MOCKER_ASSERT(!(fd_ctx->events & event));
+            return -1;
+        }
+
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events = EPOLLET | fd_ctx->events | event;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            MOCKER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                       << op << ", " << fd << ", " << epevent.events << "):"
+                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return -1;
+        }
+
+        ++m_pendingEventCount;
+        fd_ctx->events = (Event) (fd_ctx->events | event);
+        FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+        MOCKER_ASSERT(!event_ctx.scheduler && !event_ctx.coroutine && !event_ctx.cb);
+
+        event_ctx.scheduler = Scheduler::GetCurrent();
+        if (cb) {
+            event_ctx.cb.swap(cb);
+        } else {
+            event_ctx.coroutine = Coroutine::GetCurrent();
+            MOCKER_ASSERT(event_ctx.coroutine->getState() == Coroutine::EXEC);
+        }
+        return 0;
+    }
+
+    bool IOManager::delEvent(int fd, IOManager::Event event) {
+        RWMutexType::ReadLock lock(m_mutex);
+        if ((int) m_fdContexts.size() <= fd) {
+            return false;
+        }
+        FdContext *fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+
+        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        if (!(fd_ctx->events & event)) {
+            return false;
+        }
+
+        auto new_events = (Event) (fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            MOCKER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                       << op << ", " << fd << ", " << epevent.events << "):"
+                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
+
+        --m_pendingEventCount;
+        fd_ctx->events = new_events;
+        FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+        fd_ctx->resetContext(event_ctx);
+        return true;
+    }
+
+    bool IOManager::cancelEvent(int fd, IOManager::Event event) {
+        RWMutexType::ReadLock lock(m_mutex);
+        if ((int) m_fdContexts.size() <= fd) {
+            return false;
+        }
+        FdContext *fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+
+        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        if (!(fd_ctx->events & event)) {
+            return false;
+        }
+
+        auto new_events = (Event) (fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            MOCKER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                       << op << ", " << fd << ", " << epevent.events << "):"
+                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
+
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+        return true;
+    }
+
+    bool IOManager::cancelAll(int fd) {
+        RWMutexType::ReadLock lock(m_mutex);
+        if ((int) m_fdContexts.size() <= fd) {
+            return false;
+        }
+        FdContext *fd_ctx = m_fdContexts[fd];
+        lock.unlock();
+
+        FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+        if (!fd_ctx->events) {
+            return false;
+        }
+
+        int op = EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = 0;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            MOCKER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                       << op << ", " << fd << ", " << epevent.events << "):"
+                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
+        }
+
+        if (fd_ctx->events & READ) {
+            fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
+        }
+        if (fd_ctx->events & WRITE) {
+            fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
+        }
+
+        MOCKER_ASSERT(fd_ctx->events == 0);
+        return true;
+    }
+
+    IOManager *IOManager::GetCurrent() {
+        return dynamic_cast<IOManager *>(Scheduler::GetCurrent());
+    }
+
+    void IOManager::tickle() {
+        if (!hasIdleThreads()) {
+            return;
+        }
+        ssize_t rt = write_f(m_tickleFds[1], "T", 1);
+        MOCKER_ASSERT(rt == 1);
+    }
+
+    bool IOManager::stopping() {
+        return !hasTimer()
+               && m_pendingEventCount == 0
+               && m_pendingUringCount == 0
+               && Scheduler::stopping();
+    }
+
+    void IOManager::idle() {
+        const uint64_t MAX_EVENTS = 256;
+        auto *events = new epoll_event[MAX_EVENTS]();
+        std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr) {
+            delete[] ptr;
+        });
+
+        while (true) {
+            if (stopping()) {
+                MOCKER_LOG_INFO(g_logger) << "name=" << getName() << " idle stopping exit";
+                // one tickle may be drained by a single thread, pass it on
+                tickle();
+                break;
+            }
+
+            // nothing queued may wait for this thread to wake up
+            if (m_uring) {
+                flushSubmissions();
+            }
+
+            int rt;
+            do {
+                static const uint64_t MAX_TIMEOUT = 3000;
+                uint64_t next_timeout = std::min(getNextTimer(), MAX_TIMEOUT);
+                rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int) next_timeout);
+            } while (rt < 0 && errno == EINTR);
+
+            std::vector<std::function<void()>> cbs;
+            listExpiredCb(cbs);
+            if (!cbs.empty()) {
+                schedule(cbs.begin(), cbs.end());
+                cbs.clear();
+            }
+
+            for (int i = 0; i < rt; ++i) {
+                epoll_event &event = events[i];
+                if (event.data.ptr == m_tickleFds) {
+                    uint8_t dummy[256];
+                    while (read_f(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+                    continue;
+                }
+
+                if (m_uring && event.data.ptr == m_uring) {
+                    uint64_t dummy;
+                    while (read_f(m_uring->eventFd, &dummy, sizeof(dummy)) > 0);
+                    reapCompletions();
+                    continue;
+                }
+
+                auto *fd_ctx = (FdContext *) event.data.ptr;
+                FdContext::MutexType::Lock lock(fd_ctx->mutex);
+                if (event.events & (EPOLLERR | EPOLLHUP)) {
+                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                }
+
+                int real_events = NONE;
+                if (event.events & EPOLLIN) {
+                    real_events |= READ;
+                }
+                if (event.events & EPOLLOUT) {
+                    real_events |= WRITE;
+                }
+
+                if ((fd_ctx->events & real_events) == NONE) {
+                    continue;
+                }
+
+                int left_events = (fd_ctx->events & ~real_events);
+                int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                event.events = EPOLLET | left_events;
+
+                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+                if (rt2) {
+                    MOCKER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                               << op << ", " << fd_ctx->fd << ", " << event.events << "):"
+                                               << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                    continue;
+                }
+
+                if (real_events & READ) {
+                    fd_ctx->triggerEvent(READ);
+                    --m_pendingEventCount;
+                }
+                if (real_events & WRITE) {
+                    fd_ctx->triggerEvent(WRITE);
+                    --m_pendingEventCount;
+                }
+            }
+
+            Coroutine::ptr cur = Coroutine::GetCurrent();
+            auto raw_ptr = cur.get();
+            cur.reset();
+            raw_ptr->swapOut();
+        }
+    }
+
+    void IOManager::onTimerInsertedAtFront() {
+        tickle();
+    }
+
+    void IOManager::reapCompletions() {
+        std::vector<Coroutine::ptr> ready;
+        {
+            Uring::MutexType::Lock lock(m_uring->cqMutex);
+            unsigned head = *m_uring->cqHead;
+            unsigned tail = __atomic_load_n(m_uring->cqTail, __ATOMIC_ACQUIRE);
+            ready.reserve(tail - head);
+            for (; head != tail; ++head) {
+                io_uring_cqe *cqe = &m_uring->cqes[head & *m_uring->cqMask];
+                auto *comp = (Uring::Completion *) (uintptr_t) cqe->user_data;
+                // comp stays valid until its coroutine is scheduled below
+                comp->res = cqe->res;
+                ready.push_back(std::move(comp->coroutine));
+            }
+            __atomic_store_n(m_uring->cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        if (!ready.empty()) {
+            size_t count = ready.size();
+            schedule(ready.begin(), ready.end());
+            m_pendingUringCount -= count;
+        }
+        // a ring that was busy has room again
+        flushSubmissions();
+    }
+
+    void IOManager::flushSubmissions() {
+        std::vector<Coroutine::ptr> failed;
+        std::vector<Coroutine::ptr> waiters;
+        {
+            Uring::MutexType::Lock lock(m_uring->sqMutex);
+            m_uring->flushScheduled = false;
+            m_uring->submitNoLock(failed);
+            if (!m_uring->fullNoLock()) {
+                waiters.swap(m_uring->sqWaiters);
+            }
+        }
+        if (!failed.empty()) {
+            m_pendingUringCount -= failed.size();
+            schedule(failed.begin(), failed.end());
+        }
+        if (!waiters.empty()) {
+            schedule(waiters.begin(), waiters.end());
+        }
+    }
+
+    bool IOManager::canSuspend() {
+        return Scheduler::GetCurrent() == this && Coroutine::GetCoroutineId() != 0;
+    }
+
+    int64_t IOManager::uringCall(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t off) {
+        Uring::Completion comp;
+        comp.coroutine = Coroutine::GetCurrent();
+        bool schedule_flush = false;
+        while (true) {
+            std::vector<Coroutine::ptr> failed;
+            bool queued = false;
+            {
+                Uring::MutexType::Lock lock(m_uring->sqMutex);
+                if (m_uring->fullNoLock()) {
+                    // the kernel takes the queued entries, and that makes room
+                    m_uring->submitNoLock(failed);
+                }
+                if (m_uring->fullNoLock()) {
+                    // a flush after the next completions wakes it
+                    m_uring->sqWaiters.push_back(comp.coroutine);
+                } else {
+                    unsigned tail = *m_uring->sqTail;
+                    unsigned index = tail & *m_uring->sqMask;
+                    io_uring_sqe *sqe = &m_uring->sqes[index];
+                    memset(sqe, 0, sizeof(io_uring_sqe));
+                    sqe->opcode = opcode;
+                    sqe->fd = fd;
+                    sqe->addr = addr;
+                    sqe->len = len;
+                    sqe->off = off;
+                    sqe->user_data = (uint64_t) (uintptr_t) &comp;
+                    m_uring->sqArray[index] = index;
+                    __atomic_store_n(m_uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+                    ++m_pendingUringCount;
+                    queued = true;
+                    schedule_flush = !m_uring->flushScheduled;
+                    m_uring->flushScheduled = true;
+                }
+            }
+            if (!failed.empty()) {
+                m_pendingUringCount -= failed.size();
+                schedule(failed.begin(), failed.end());
+            }
+            if (queued) {
+                break;
+            }
+            Coroutine::Sleep();
+        }
+
+        /*
+         * An idle worker flushes before it waits. With none, a flush task
+         * goes behind the queued tasks, and their SQEs go out with this one.
+         */
+        if (schedule_flush) {
+            if (hasIdleThreads()) {
+                tickle();
+            } else {
+                schedule(std::bind(&IOManager::flushSubmissions, this));
+            }
+        }
+        Coroutine::Sleep();
+
+        if (comp.res < 0) {
+            errno = -comp.res;
+            return -1;
+        }
+        return comp.res;
+    }
+
+    /**
+     * Retry fun until fd stops returning EAGAIN, parking the current
+     * coroutine on epoll in between.
+     */
+    template<class Fun>
+    static auto wait_ready(IOManager *iom, int fd, IOManager::Event event, Fun fun) -> decltype(fun()) {
+        while (true) {
+            auto n = fun();
+            if (n == -1 && errno == EAGAIN) {
+                if (iom->addEvent(fd, event) == 0) {
+                    Coroutine::Sleep();
+                    continue;
+                }
+            }
+            return n;
+        }
+    }
+
+    ssize_t IOManager::read(int fd, void *buf, size_t count, off_t offset) {
+        if (!canSuspend()) {
+            return offset == -1 ? read_f(fd, buf, count) : ::pread(fd, buf, count, offset);
+        }
+        if (m_uring) {
+            // an SQE length is 32 bits, a shorter transfer is a legal result
+            return uringCall(IORING_OP_READ, fd, (uint64_t) (uintptr_t) buf,
+                             (uint32_t) std::min<size_t>(count, UINT32_MAX), (uint64_t) offset);
+        }
+        return wait_ready(this, fd, READ, [=]() {
+            return offset == -1 ? read_f(fd, buf, count) : ::pread(fd, buf, count, offset);
+        });
+    }
+
+    ssize_t IOManager::write(int fd, const void *buf, size_t count, off_t offset) {
+        if (!canSuspend()) {
+            return offset == -1 ? write_f(fd, buf, count) : ::pwrite(fd, buf, count, offset);
+        }
+        if (m_uring) {
+            // an SQE length is 32 bits, a shorter transfer is a legal result
+            return uringCall(IORING_OP_WRITE, fd, (uint64_t) (uintptr_t) buf,
+                             (uint32_t) std::min<size_t>(count, UINT32_MAX), (uint64_t) offset);
+        }
+        return wait_ready(this, fd, WRITE, [=]() {
+            return offset == -1 ? write_f(fd, buf, count) : ::pwrite(fd, buf, count, offset);
+        });
+    }
+
+    int IOManager::accept(int fd, sockaddr *addr, socklen_t *addrlen) {
+        if (!canSuspend()) {
+            return accept_f(fd, addr, addrlen);
+        }
+        if (m_uring) {
+            return (int) uringCall(IORING_OP_ACCEPT, fd, (uint64_t) (uintptr_t) addr,
+                                   0, (uint64_t) (uintptr_t) addrlen);
+        }
+        return wait_ready(this, fd, READ, [=]() {
+            return accept_f(fd, addr, addrlen);
+        });
+    }
+
+    int IOManager::connect(int fd, const sockaddr *addr, socklen_t addrlen) {
+        if (!canSuspend()) {
+            return connect_f(fd, addr, addrlen);
+        }
+        if (m_uring) {
+            return (int) uringCall(IORING_OP_CONNECT, fd, (uint64_t) (uintptr_t) addr,
+                                   0, addrlen);
+        }
+
+        int rt = connect_f(fd, addr, addrlen);
+        if (rt == 0 || errno != EINPROGRESS) {
+            return rt;
+        }
+        if (addEvent(fd, WRITE) != 0) {
+            return -1;
+        }
+        Coroutine::Sleep();
+
+        int error = 0;
+        socklen_t len = sizeof(int);
+        if (getsockopt_f(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+            return -1;
+        }
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+
+    int IOManager::fsync(int fd) {
+        if (canSuspend() && m_uring) {
+            return (int) uringCall(IORING_OP_FSYNC, fd, 0, 0, 0);
+        }
+        // epoll can't wait on regular files
+        return ::fsync(fd);
+    }
+
+}
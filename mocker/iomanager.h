@@ -0,0 +1,148 @@
+#ifndef MOCKER_IOMANAGER_H
+#define MOCKER_IOMANAGER_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <mocker/schedule.h>
+#include <mocker/timer.h>
+
+namespace mocker {
+
+    /**
+     * Scheduler driven by epoll. With iomanager.io_uring on and a kernel
+     * that supports it, an io_uring ring is attached to the same epoll set
+     * through an eventfd, so fd readiness and io_uring completions are
+     * reaped by one idle loop. SQEs are queued by the coroutines and
+     * submitted in batches, by an idle worker before it waits, or by one
+     * flush task per batch when no worker is idle.
+     */
+    class IOManager : public Scheduler, public TimerManager {
+    public:
+        typedef std::shared_ptr<IOManager> ptr;
+        typedef RWMutex RWMutexType;
+
+        enum Event {
+            NONE  = 0x0,
+            READ  = 0x1,    // EPOLLIN
+            WRITE = 0x4     // EPOLLOUT
+        };
+
+        enum Engine {
+            EPOLL,
+            IO_URING
+        };
+
+    private:
+        struct FdContext {
+            typedef Mutex MutexType;
+
+            struct EventContext {
+                Scheduler *scheduler = nullptr;
+                Coroutine::ptr coroutine;
+                Coroutine::task cb;
+            };
+
+            EventContext &getContext(Event event);
+
+            void resetContext(EventContext &ctx);
+
+            void triggerEvent(Event event);
+
+            EventContext read;
+            EventContext write;
+            int fd = 0;
+            Event events = NONE;
+            MutexType mutex;
+        };
+
+        struct Uring;
+
+    public:
+        /**
+         * @param use_uring try io_uring first if iomanager.io_uring is on,
+         *                  and fall back to epoll when the ring can not be
+         *                  set up
+         */
+        explicit IOManager(size_t threads = 1, bool use_caller = true,
+                           const std::string &name = "", bool use_uring = true);
+
+        ~IOManager() override;
+
+        /**
+         * Wait for an event on fd. Without cb the current coroutine is
+         * resumed when the event fires.
+         * @return 0 success, -1 error
+         */
+        int addEvent(int fd, Event event, Coroutine::task cb = nullptr);
+
+        // remove the event without triggering it
+        bool delEvent(int fd, Event event);
+
+        // remove the event and trigger it
+        bool cancelEvent(int fd, Event event);
+
+        bool cancelAll(int fd);
+
+        Engine getEngine() const { return m_uring ? IO_URING : EPOLL; }
+
+        /*
+         * Coroutine I/O. Called from a coroutine of this IOManager, the
+         * caller is suspended until the operation completes: through an
+         * io_uring SQE, or by waiting on epoll for a non-blocking fd.
+         * Anywhere else they are plain blocking calls. They return like
+         * the syscalls, -1 with errno on error. offset -1 means the
+         * current file position.
+         */
+        ssize_t read(int fd, void *buf, size_t count, off_t offset = -1);
+
+        ssize_t write(int fd, const void *buf, size_t count, off_t offset = -1);
+
+        int accept(int fd, sockaddr *addr, socklen_t *addrlen);
+
+        int connect(int fd, const sockaddr *addr, socklen_t addrlen);
+
+        int fsync(int fd);
+
+    public:
+        static IOManager *GetCurrent();
+
+    protected:
+        void tickle() override;
+
+        bool stopping() override;
+
+        void idle() override;
+
+        void onTimerInsertedAtFront() override;
+
+        void contextResize(size_t size);
+
+    private:
+        bool canSuspend();
+
+        int64_t uringCall(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t off);
+
+        // submit the queued SQEs in one io_uring_enter, wake coroutines waiting for room
+        void flushSubmissions();
+
+        void reapCompletions();
+
+    private:
+        int m_epfd = 0;
+        int m_tickleFds[2];
+
+        std::atomic<size_t> m_pendingEventCount = {0};
+        std::atomic<size_t> m_pendingUringCount = {0};
+        RWMutexType m_mutex;
+        std::vector<FdContext *> m_fdContexts;
+
+        Uring *m_uring = nullptr;
+    };
+
+}
+
+#endif //MOCKER_IOMANAGER_H
@@ -405,7 +405,7 @@ namespace mocker {
     ////////////////////////////////////////////////////////////////////
     /// Logger
     ////////////////////////////////////////////////////////////////////
-    Logger::Logger(const std::string &name) : m_name(name), m_level(LogLevel::DEBUG) {
+    Logger::Logger(const std::string &name) : m_name(name), m_level(LogLevel::DEBUG), m_mutex("log.logger") {
         m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
     }
 
@@ -520,7 +520,7 @@ namespace mocker {
     ////////////////////////////////////////////////////////////////////
     /// LogAppender
     ////////////////////////////////////////////////////////////////////
-    LogAppender::LogAppender(LogLevel::Level level) : m_level(level) {
+    LogAppender::LogAppender(LogLevel::Level level) : m_level(level), m_mutex("log.appender") {
 
     }
 
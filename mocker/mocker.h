@@ -5,14 +5,24 @@
 #ifndef MOCKER_MOCKER_H
 #define MOCKER_MOCKER_H
 
+#include <mocker/affinity.h>
+#include <mocker/channel.h>
+#include <mocker/co_sync.h>
 #include <mocker/config.h>
+#include <mocker/config_watcher.h>
 #include <mocker/coroutine.h>
+#include <mocker/fd_manager.h>
+#include <mocker/hook.h>
+#include <mocker/iomanager.h>
 #include <mocker/log.h>
 #include <mocker/macro.h>
 #include <mocker/mutex.h>
 #include <mocker/schedule.h>
 #include <mocker/thread.h>
+#include <mocker/thread_pool.h>
+#include <mocker/timer.h>
 #include <mocker/util.h>
+#include <mocker/watchdog.h>
 
 #endif //MOCKER_MOCKER_H
 
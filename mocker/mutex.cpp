@@ -2,12 +2,128 @@
 // Created by ChaosChen on 2021/7/30.
 //
 
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
 
+#include <mocker/log.h>
+#include <mocker/macro.h>
 #include <mocker/mutex.h>
 
 namespace mocker {
 
+    ////////////////////////////////////////////////////////////////////
+    /// LockProfile
+    ////////////////////////////////////////////////////////////////////
+    static Mutex &GetProfilesMutex() {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    static std::map<std::string, LockProfile *> &GetProfiles() {
+        static std::map<std::string, LockProfile *> s_profiles;
+        return s_profiles;
+    }
+
+    LockProfile::LockProfile(const std::string &name)
+            : m_name(name) {
+        for (auto &i : m_waitHist) {
+            i = 0;
+        }
+    }
+
+    LockProfile *LockProfile::Get(const char *name) {
+        Mutex::Lock lock(GetProfilesMutex());
+        LockProfile *&profile = GetProfiles()[name];
+        if (!profile) {
+            profile = new LockProfile(name);
+        }
+        return profile;
+    }
+
+    std::vector<LockProfile::Data> LockProfile::GetAll() {
+        std::vector<Data> res;
+        {
+            Mutex::Lock lock(GetProfilesMutex());
+            for (auto &i : GetProfiles()) {
+                res.push_back(i.second->getData());
+            }
+        }
+        std::sort(res.begin(), res.end(), [](const Data &a, const Data &b) {
+            return a.waitNs > b.waitNs;
+        });
+        return res;
+    }
+
+    std::string LockProfile::Report() {
+        std::stringstream ss;
+        ss << std::left << std::setw(24) << "name" << std::right
+           << std::setw(12) << "acquire" << std::setw(12) << "contended"
+           << std::setw(12) << "wait_ms" << std::setw(12) << "max_wait_us"
+           << std::setw(12) << "hold_ms" << "  wait histogram (4^i ns)" << std::endl;
+        for (auto &d : GetAll()) {
+            ss << std::left << std::setw(24) << d.name << std::right
+               << std::setw(12) << d.acquisitions << std::setw(12) << d.contended
+               << std::setw(12) << d.waitNs / 1000000.0 << std::setw(12) << d.maxWaitNs / 1000.0
+               << std::setw(12) << d.holdNs / 1000000.0 << " ";
+            // trailing empty buckets are left out
+            int last = kBuckets - 1;
+            while (last >= 0 && !d.waitHist[last]) {
+                --last;
+            }
+            for (int i = 0; i <= last; ++i) {
+                ss << " " << d.waitHist[i];
+            }
+            ss << std::endl;
+        }
+        return ss.str();
+    }
+
+    uint64_t LockProfile::NowNs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    void LockProfile::acquired(bool contended, uint64_t wait_ns) {
+        m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (!contended) {
+            return;
+        }
+        m_contended.fetch_add(1, std::memory_order_relaxed);
+        m_waitNs.fetch_add(wait_ns, std::memory_order_relaxed);
+        int bucket = wait_ns ? (63 - __builtin_clzll(wait_ns)) / 2 : 0;
+        m_waitHist[std::min(bucket, kBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = m_maxWaitNs.load(std::memory_order_relaxed);
+        while (wait_ns > max && !m_maxWaitNs.compare_exchange_weak(max, wait_ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    LockProfile::Data LockProfile::getData() const {
+        Data d;
+        d.name = m_name;
+        d.acquisitions = m_acquisitions;
+        d.contended = m_contended;
+        d.waitNs = m_waitNs;
+        d.holdNs = m_holdNs;
+        d.maxWaitNs = m_maxWaitNs;
+        for (int i = 0; i < kBuckets; ++i) {
+            d.waitHist[i] = m_waitHist[i];
+        }
+        return d;
+    }
+
+
     ////////////////////////////////////////////////////////////////////
     /// Semaphore
     ////////////////////////////////////////////////////////////////////
@@ -27,10 +143,205 @@ namespace mocker {
         }
     }
 
+    bool Semaphore::tryWait() {
+        while (sem_trywait(&m_semaphore)) {
+            if (errno == EAGAIN) {
+                return false;
+            }
+            if (errno != EINTR) {
+                throw std::logic_error("sem_trywait error");
+            }
+        }
+        return true;
+    }
+
+    bool Semaphore::waitFor(uint64_t ms) {
+        // sem_timedwait only takes CLOCK_REALTIME
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = ts.tv_nsec + ms % 1000 * 1000000;
+        ts.tv_sec += ms / 1000 + ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while (sem_timedwait(&m_semaphore, &ts)) {
+            if (errno == ETIMEDOUT) {
+                return false;
+            }
+            if (errno != EINTR) {
+                throw std::logic_error("sem_timedwait error");
+            }
+        }
+        return true;
+    }
+
     void Semaphore::notify() {
         if (sem_post(&m_semaphore)) {
             throw std::logic_error("sem_post error");
         }
     }
 
+
+    ////////////////////////////////////////////////////////////////////
+    /// AdaptiveMutex
+    ////////////////////////////////////////////////////////////////////
+    static const int s_max_spin_count = 100;
+    static const int s_max_backoff = 64;
+
+    static bool is_multi_cpu() {
+        static bool s_multi = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+        return s_multi;
+    }
+
+    static long futex(std::atomic<int> *addr, int op, int val) {
+        return syscall(SYS_futex, (int *) addr, op, val, nullptr, nullptr, 0);
+    }
+
+    void AdaptiveMutex::lockSlow() {
+#ifdef MOCKER_MUTEX_STATS
+        ++m_contended;
+#endif
+        if (is_multi_cpu()) {
+            int spin_count = m_spinCount.load(std::memory_order_relaxed);
+            int max_spins = std::min(s_max_spin_count, spin_count * 2 + 10);
+            int backoff = 1;
+            int spins = 0;
+            for (; spins < max_spins; ++spins) {
+                for (int i = 0; i < backoff; ++i) {
+                    CpuRelax();
+                }
+                backoff = std::min(backoff * 2, s_max_backoff);
+
+                int c = 0;
+                if (m_state.load(std::memory_order_relaxed) == 0
+                    && m_state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+                    m_spinCount.store(spin_count + (spins - spin_count) / 8, std::memory_order_relaxed);
+#ifdef MOCKER_MUTEX_STATS
+                    ++m_spinAcquired;
+#endif
+                    return;
+                }
+            }
+            m_spinCount.store(spin_count + (spins - spin_count) / 8, std::memory_order_relaxed);
+        }
+
+        // we may not be the only sleeper, so 2 on every wake up as well
+        int c = m_state.exchange(2, std::memory_order_acquire);
+        while (c != 0) {
+#ifdef MOCKER_MUTEX_STATS
+            ++m_futexWaits;
+#endif
+            futex(&m_state, FUTEX_WAIT_PRIVATE, 2);
+            c = m_state.exchange(2, std::memory_order_acquire);
+        }
+    }
+
+    void AdaptiveMutex::wake() {
+        futex(&m_state, FUTEX_WAKE_PRIVATE, 1);
+    }
+
+    AdaptiveMutex::Stats AdaptiveMutex::getStats() const {
+        Stats stats;
+#ifdef MOCKER_MUTEX_STATS
+        stats.acquisitions = m_acquisitions;
+        stats.contended = m_contended;
+        stats.spinAcquired = m_spinAcquired;
+        stats.futexWaits = m_futexWaits;
+        stats.holdNs = m_holdNs;
+#endif
+        return stats;
+    }
+
+#ifdef MOCKER_MUTEX_STATS
+    uint64_t AdaptiveMutex::NowNs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+#endif
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// DistributedRWMutex
+    ////////////////////////////////////////////////////////////////////
+    static const size_t s_max_reader_slots = 64;
+
+    static std::atomic<size_t> s_thread_index{0};
+    // its address tells the threads apart
+    static thread_local size_t t_thread_index = s_thread_index++;
+    // read sides held by this thread, catches one released by a migrated coroutine
+    static thread_local int t_read_locks = 0;
+
+    // spin a little, then give the cpu away
+    static void wait_a_moment(int &spins) {
+        if (++spins < 64 && is_multi_cpu()) {
+            CpuRelax();
+        } else {
+            sched_yield();
+        }
+    }
+
+    DistributedRWMutex::DistributedRWMutex() {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        m_slotCount = std::min(s_max_reader_slots, (size_t) std::max(cpus, 1l));
+        // new[] of an over-aligned type is not aligned before C++17
+        void *mem = nullptr;
+        if (posix_memalign(&mem, alignof(Slot), sizeof(Slot) * m_slotCount)) {
+            throw std::bad_alloc();
+        }
+        m_slots = (Slot *) mem;
+        for (size_t i = 0; i < m_slotCount; ++i) {
+            new(&m_slots[i]) Slot();
+        }
+    }
+
+    DistributedRWMutex::~DistributedRWMutex() {
+        free(m_slots);
+    }
+
+    DistributedRWMutex::Slot &DistributedRWMutex::getSlot() {
+        return m_slots[t_thread_index % m_slotCount];
+    }
+
+    void DistributedRWMutex::rdlock() {
+        Slot &slot = getSlot();
+        while (true) {
+            // pairs with the flag store and slot loads in wrlock
+            slot.readers.fetch_add(1, std::memory_order_seq_cst);
+            if (!m_writing.load(std::memory_order_seq_cst)) {
+                ++t_read_locks;
+                return;
+            }
+            slot.readers.fetch_sub(1, std::memory_order_release);
+
+            int spins = 0;
+            while (m_writing.load(std::memory_order_acquire)) {
+                wait_a_moment(spins);
+            }
+        }
+    }
+
+    void DistributedRWMutex::wrlock() {
+        m_writeMutex.lock();
+        m_writing.store(true, std::memory_order_seq_cst);
+        for (size_t i = 0; i < m_slotCount; ++i) {
+            int spins = 0;
+            while (m_slots[i].readers.load(std::memory_order_seq_cst) != 0) {
+                wait_a_moment(spins);
+            }
+        }
+        m_writer.store(&t_thread_index, std::memory_order_relaxed);
+    }
+
+    void DistributedRWMutex::unlock() {
+        if (m_writer.load(std::memory_order_relaxed) == &t_thread_index) {
+            m_writer.store(nullptr, std::memory_order_relaxed);
+            m_writing.store(false, std::memory_order_release);
+            m_writeMutex.unlock();
+        } else {
+            MOCKER_ASSERT2(t_read_locks > 0, "DistributedRWMutex read side released on another thread, "
+                                             "a coroutine must not yield while holding it");
+            --t_read_locks;
+            getSlot().readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
 }
@@ -8,15 +8,105 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
 
 namespace mocker {
 
+    // tell the cpu we are spinning, cheaper for the sibling hyper-thread
+    inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#else
+        asm volatile("" ::: "memory");
+#endif
+    }
+
+
+    /**
+     * Contention of all locks constructed with the same name. Mutex,
+     * Spinlock and RWMutex feed it when built with MOCKER_LOCK_PROFILE
+     * and given a name; otherwise the hooks are compiled out and the
+     * name is ignored. Hold time is measured for exclusive holders only.
+     */
+    class LockProfile {
+    public:
+        // wait histogram, bucket i counts waits in [4^i, 4^(i+1)) ns
+        static const int kBuckets = 16;
+
+        struct Data {
+            std::string name;
+            uint64_t acquisitions = 0;
+            uint64_t contended = 0;
+            uint64_t waitNs = 0;
+            uint64_t holdNs = 0;
+            uint64_t maxWaitNs = 0;
+            uint64_t waitHist[kBuckets] = {0};
+        };
+
+        // the profile of name, created on first use and never freed
+        static LockProfile *Get(const char *name);
+
+        // every profile, most total wait first
+        static std::vector<Data> GetAll();
+
+        // GetAll() as a table
+        static std::string Report();
+
+        static uint64_t NowNs();
+
+        void acquired(bool contended, uint64_t wait_ns);
+
+        void released(uint64_t hold_ns) {
+            m_holdNs.fetch_add(hold_ns, std::memory_order_relaxed);
+        }
+
+        Data getData() const;
+
+    private:
+        explicit LockProfile(const std::string &name);
+
+    private:
+        std::string m_name;
+        std::atomic<uint64_t> m_acquisitions{0};
+        std::atomic<uint64_t> m_contended{0};
+        std::atomic<uint64_t> m_waitNs{0};
+        std::atomic<uint64_t> m_holdNs{0};
+        std::atomic<uint64_t> m_maxWaitNs{0};
+        std::atomic<uint64_t> m_waitHist[kBuckets];
+    };
+
+#ifdef MOCKER_LOCK_PROFILE
+/*
+ * Lock through a profile: try first and time the blocking call only if
+ * that fails. Leaves the time the lock was taken in stamp.
+ */
+#define MOCKER_PROFILED_LOCK(profile, try_lock, do_lock, stamp) \
+        if (try_lock) { \
+            stamp = LockProfile::NowNs(); \
+            profile->acquired(false, 0); \
+        } else { \
+            uint64_t mocker_t0 = LockProfile::NowNs(); \
+            do_lock; \
+            stamp = LockProfile::NowNs(); \
+            profile->acquired(true, stamp - mocker_t0); \
+        }
+#endif
+
+
     class Semaphore {
     public:
         Semaphore(uint32_t count = 0);
         ~Semaphore();
 
         void wait();
+        // false instead of blocking
+        bool tryWait();
+        // false after ms without a notify
+        bool waitFor(uint64_t ms);
         void notify();
     public:
 
@@ -95,8 +185,11 @@ namespace mocker {
     public:
         typedef ReadScopedLockImple<RWMutex> ReadLock;
         typedef WriteScopedLockImple<RWMutex> WriteLock;
-        RWMutex() {
+        explicit RWMutex(const char *name = nullptr) {
             pthread_rwlock_init(&m_lock, nullptr);
+#ifdef MOCKER_LOCK_PROFILE
+            m_profile = name ? LockProfile::Get(name) : nullptr;
+#endif
         }
 
         ~RWMutex() {
@@ -104,19 +197,48 @@ namespace mocker {
         }
 
         void rdlock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                uint64_t stamp;
+                MOCKER_PROFILED_LOCK(m_profile, !pthread_rwlock_tryrdlock(&m_lock),
+                                     pthread_rwlock_rdlock(&m_lock), stamp);
+                (void) stamp;
+                return;
+            }
+#endif
             pthread_rwlock_rdlock(&m_lock);
         }
 
         void wrlock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                MOCKER_PROFILED_LOCK(m_profile, !pthread_rwlock_trywrlock(&m_lock),
+                                     pthread_rwlock_wrlock(&m_lock), m_lockedAt);
+                m_writeLocked = true;
+                return;
+            }
+#endif
             pthread_rwlock_wrlock(&m_lock);
         }
 
         void unlock() {
+#ifdef MOCKER_LOCK_PROFILE
+            // readers never see it set, the writer excludes them
+            if (m_writeLocked) {
+                m_writeLocked = false;
+                m_profile->released(LockProfile::NowNs() - m_lockedAt);
+            }
+#endif
             pthread_rwlock_unlock(&m_lock);
         }
 
     private:
         pthread_rwlock_t m_lock;
+#ifdef MOCKER_LOCK_PROFILE
+        LockProfile *m_profile;
+        uint64_t m_lockedAt = 0;
+        bool m_writeLocked = false;
+#endif
     };
 
 
@@ -153,8 +275,11 @@ namespace mocker {
     class Mutex {
     public:
         typedef ScopedLockImple<Mutex> Lock;
-        Mutex() {
+        explicit Mutex(const char *name = nullptr) {
             pthread_mutex_init(&m_mutex, nullptr);
+#ifdef MOCKER_LOCK_PROFILE
+            m_profile = name ? LockProfile::Get(name) : nullptr;
+#endif
         }
 
         ~Mutex() {
@@ -162,24 +287,43 @@ namespace mocker {
         }
 
         void lock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                MOCKER_PROFILED_LOCK(m_profile, !pthread_mutex_trylock(&m_mutex),
+                                     pthread_mutex_lock(&m_mutex), m_lockedAt);
+                return;
+            }
+#endif
             pthread_mutex_lock(&m_mutex);
         }
 
         void unlock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                m_profile->released(LockProfile::NowNs() - m_lockedAt);
+            }
+#endif
             pthread_mutex_unlock(&m_mutex);
         }
 
 
     private:
         pthread_mutex_t m_mutex;
+#ifdef MOCKER_LOCK_PROFILE
+        LockProfile *m_profile;
+        uint64_t m_lockedAt = 0;
+#endif
     };
 
 
     class Spinlock {
     public:
         typedef ScopedLockImple<Spinlock> Lock;
-        Spinlock() {
+        explicit Spinlock(const char *name = nullptr) {
             pthread_spin_init(&m_mutex, 0);
+#ifdef MOCKER_LOCK_PROFILE
+            m_profile = name ? LockProfile::Get(name) : nullptr;
+#endif
         }
 
         ~Spinlock() {
@@ -187,15 +331,31 @@ namespace mocker {
         }
 
         void lock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                MOCKER_PROFILED_LOCK(m_profile, !pthread_spin_trylock(&m_mutex),
+                                     pthread_spin_lock(&m_mutex), m_lockedAt);
+                return;
+            }
+#endif
             pthread_spin_lock(&m_mutex);
         }
 
         void unlock() {
+#ifdef MOCKER_LOCK_PROFILE
+            if (m_profile) {
+                m_profile->released(LockProfile::NowNs() - m_lockedAt);
+            }
+#endif
             pthread_spin_unlock(&m_mutex);
         }
 
     private:
         pthread_spinlock_t m_mutex;
+#ifdef MOCKER_LOCK_PROFILE
+        LockProfile *m_profile;
+        uint64_t m_lockedAt = 0;
+#endif
     };
 
 
@@ -211,7 +371,9 @@ namespace mocker {
         }
 
         void lock() {
-            while (std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire));
+            while (std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire)) {
+                CpuRelax();
+            }
         }
 
         void unlock() {
@@ -222,6 +384,140 @@ namespace mocker {
     };
 
 
+    /**
+     * Futex lock which spins before it sleeps. A contended lock() retries
+     * with pause and exponential backoff for up to about twice the spins
+     * that recently succeeded, like glibc's adaptive mutex, then parks on
+     * the futex. Uncontended lock/unlock is one atomic each, no syscall.
+     * On a single cpu it never spins, the holder can not run meanwhile.
+     *
+     * Built with MOCKER_MUTEX_STATS it counts contention and hold time.
+     */
+    class AdaptiveMutex {
+    public:
+        typedef ScopedLockImple<AdaptiveMutex> Lock;
+
+        struct Stats {
+            uint64_t acquisitions = 0;
+            // the first try failed
+            uint64_t contended = 0;
+            // contended but got it by spinning
+            uint64_t spinAcquired = 0;
+            uint64_t futexWaits = 0;
+            uint64_t holdNs = 0;
+        };
+
+        AdaptiveMutex() = default;
+
+        AdaptiveMutex(const AdaptiveMutex &) = delete;
+        AdaptiveMutex &operator=(const AdaptiveMutex &) = delete;
+
+        void lock() {
+            int c = 0;
+            if (!m_state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+                lockSlow();
+            }
+#ifdef MOCKER_MUTEX_STATS
+            ++m_acquisitions;
+            m_lockedAt = NowNs();
+#endif
+        }
+
+        bool tryLock() {
+            int c = 0;
+            return m_state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+        }
+
+        void unlock() {
+#ifdef MOCKER_MUTEX_STATS
+            m_holdNs += NowNs() - m_lockedAt;
+#endif
+            if (m_state.exchange(0, std::memory_order_release) == 2) {
+                wake();
+            }
+        }
+
+        // all zero unless built with MOCKER_MUTEX_STATS
+        Stats getStats() const;
+
+        int getSpinCount() const { return m_spinCount; }
+
+    private:
+        void lockSlow();
+
+        void wake();
+
+#ifdef MOCKER_MUTEX_STATS
+        static uint64_t NowNs();
+#endif
+
+    private:
+        // 0 unlocked, 1 locked, 2 locked and someone may sleep on it
+        std::atomic<int> m_state{0};
+        // average spins a contended lock needed, tuned on every slow path
+        std::atomic<int> m_spinCount{0};
+
+#ifdef MOCKER_MUTEX_STATS
+        std::atomic<uint64_t> m_acquisitions{0};
+        std::atomic<uint64_t> m_contended{0};
+        std::atomic<uint64_t> m_spinAcquired{0};
+        std::atomic<uint64_t> m_futexWaits{0};
+        std::atomic<uint64_t> m_holdNs{0};
+        // written by the holder only
+        uint64_t m_lockedAt = 0;
+#endif
+    };
+
+
+    /**
+     * Reader-writer lock for read-mostly data. Every thread counts its
+     * reads in a slot on a cache line of its own, so readers on different
+     * cores never write to the same line. A writer raises a flag that holds
+     * off new readers and waits for all slots to drain; writers queue on an
+     * AdaptiveMutex. Reads scale, a write costs a scan of the slots.
+     *
+     * Not recursive: a pending writer blocks a second rdlock of a thread
+     * that still holds the first one.
+     *
+     * The slot follows the thread: a coroutine must not suspend while it
+     * holds the read side, or it may resume on another worker and release
+     * that worker's slot. Use it only around code that never yields.
+     */
+    class DistributedRWMutex {
+    public:
+        typedef ReadScopedLockImple<DistributedRWMutex> ReadLock;
+        typedef WriteScopedLockImple<DistributedRWMutex> WriteLock;
+
+        DistributedRWMutex();
+
+        ~DistributedRWMutex();
+
+        DistributedRWMutex(const DistributedRWMutex &) = delete;
+        DistributedRWMutex &operator=(const DistributedRWMutex &) = delete;
+
+        void rdlock();
+
+        void wrlock();
+
+        void unlock();
+
+    private:
+        struct alignas(64) Slot {
+            std::atomic<int> readers{0};
+        };
+
+        Slot &getSlot();
+
+    private:
+        Slot *m_slots;
+        size_t m_slotCount;
+        std::atomic<bool> m_writing{false};
+        // the writing thread, unlock() releases the write side for it
+        std::atomic<const void *> m_writer{nullptr};
+        AdaptiveMutex m_writeMutex;
+    };
+
+
     // Fake mutex
     class NullMutex {
     public:
@@ -3,23 +3,204 @@
 //
 
 #include <mocker/schedule.h>
+#include <mocker/config.h>
+#include <mocker/hook.h>
 #include <mocker/log.h>
 #include <mocker/macro.h>
+#include <mocker/util.h>
+#include <algorithm>
+#include <iterator>
 #include <functional>
+#include <set>
+#include <sstream>
 
 namespace mocker {
     static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+    static Logger::ptr g_metrics_logger = MOCKER_LOG_NAME("metrics");
+
+    // run queue nodes a thread keeps for reuse
+    static const size_t s_spare_nodes = 256;
 
     static thread_local Scheduler *t_scheduler = nullptr;
     static thread_local Coroutine *t_coroutine = nullptr;
 
+    static ConfigVar<AffinityPolicy>::ptr g_scheduler_affinity =
+            Config::Lookup("scheduler.affinity", AffinityPolicy(),
+                           "cpu affinity and nice of scheduler workers");
+
+    static ConfigVar<uint64_t>::ptr g_scheduler_max_wait =
+            Config::Lookup<uint64_t>("scheduler.max_wait_ms", 50,
+                                     "a task waiting longer runs ahead of higher classes, 0 never");
+
+    static ConfigVar<uint64_t>::ptr g_scheduler_metrics_dump =
+            Config::Lookup<uint64_t>("scheduler.metrics_dump_ms", 0,
+                                     "log the metrics of every scheduler this often, 0 never");
+
+    static ConfigVar<bool>::ptr g_scheduler_metrics_timing =
+            Config::Lookup<bool>("scheduler.metrics_timing", false,
+                                 "time every task for the busy, idle, wait and run metrics");
+
+    static ConfigVar<size_t>::ptr g_scheduler_thread_stack_size =
+            Config::Lookup<size_t>("scheduler.thread.stack_size", 0,
+                                   "pthread stack size of scheduler workers, 0 for the default");
+
+    static ConfigVar<size_t>::ptr g_scheduler_thread_guard_size =
+            Config::Lookup<size_t>("scheduler.thread.guard_size", 0,
+                                   "pthread stack guard size of scheduler workers, 0 for the default");
+
+    static ConfigVar<bool>::ptr g_scheduler_thread_prefault =
+            Config::Lookup("scheduler.thread.prefault_stack", false,
+                           "fault in the whole stack of a worker before it runs");
+
+
+    ////////////////////////////////////////////////////////////////////
+    /// Metrics
+    ////////////////////////////////////////////////////////////////////
+    uint64_t Scheduler::Histogram::count() const {
+        uint64_t n = 0;
+        for (auto c : counts) {
+            n += c;
+        }
+        return n;
+    }
+
+    uint64_t Scheduler::Histogram::percentile(double p) const {
+        uint64_t n = count();
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (n && seen >= p * n) {
+                return 1ull << i;
+            }
+        }
+        return 0;
+    }
+
+    void Scheduler::Histogram::merge(const Histogram &other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+    }
+
+    void Scheduler::WorkerMetrics::merge(const WorkerMetrics &other) {
+        tasks += other.tasks;
+        switches += other.switches;
+        migrations += other.migrations;
+        busyUs += other.busyUs;
+        idleUs += other.idleUs;
+        wait.merge(other.wait);
+        run.merge(other.run);
+    }
+
+    static std::ostream &operator<<(std::ostream &os, const Scheduler::WorkerMetrics &m) {
+        uint64_t total_us = m.busyUs + m.idleUs;
+        os << "tasks=" << m.tasks << " busy=" << (total_us ? m.busyUs * 100 / total_us : 0) << "%"
+           << " wait p50/p99=" << m.wait.percentile(0.5) << "/" << m.wait.percentile(0.99) << "us"
+           << " run p50/p99=" << m.run.percentile(0.5) << "/" << m.run.percentile(0.99) << "us"
+           << " switches=" << m.switches << " migrations=" << m.migrations;
+        return os;
+    }
+
+    std::string Scheduler::Metrics::toString() const {
+        static const char *classes[PRIORITY_COUNT] = {"deadline", "high", "normal", "background"};
+        std::stringstream ss;
+        ss << "scheduler " << name << ": active=" << activeThreads << " idle=" << idleThreads << " queued";
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            ss << " " << classes[i] << "=" << queues[i].depth << "/" << queues[i].maxDepth;
+        }
+        ss << "\n    total: " << total;
+        for (auto &worker : workers) {
+            ss << "\n    " << worker.thread << ": " << worker;
+        }
+        return ss.str();
+    }
+
+    // a coroutine dump looks up the name of the scheduler it last ran in
+    struct LiveSchedulers {
+        Mutex mutex;
+        std::set<const Scheduler *> schedulers;
+    };
+
+    static LiveSchedulers &GetLiveSchedulers() {
+        static LiveSchedulers live;
+        return live;
+    }
+
+    /*
+     * Written by its worker alone, so a relaxed load and store does for an
+     * increment, no locked instruction on the hot path. getMetrics() reads
+     * them from other threads.
+     */
+    struct Scheduler::WorkerCounters {
+        typedef std::atomic<uint64_t> Counter;
+
+        pid_t thread;
+        Counter tasks{0};
+        Counter switches{0};
+        Counter migrations{0};
+        Counter busyUs{0};
+        Counter idleUs{0};
+        Counter wait[Histogram::BUCKETS];
+        Counter run[Histogram::BUCKETS];
+
+        explicit WorkerCounters(pid_t thr) : thread(thr) {
+            for (int i = 0; i < Histogram::BUCKETS; ++i) {
+                wait[i].store(0, std::memory_order_relaxed);
+                run[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        static void Add(Counter &counter, uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        // a task came back to the worker, begin is when it was taken, 0 untimed
+        void addRun(uint64_t begin, Coroutine::State state) {
+            if (state == Coroutine::TERM || state == Coroutine::EXCEPT) {
+                Add(tasks);
+            }
+            Add(switches);
+            if (begin) {
+                uint64_t us = GetCurrentUS() - begin;
+                Add(busyUs, us);
+                Add(run[Histogram::Bucket(us)]);
+            }
+        }
+
+        static void Load(const Counter *counters, Histogram &histogram) {
+            for (int i = 0; i < Histogram::BUCKETS; ++i) {
+                histogram.counts[i] = counters[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        WorkerMetrics load() const {
+            WorkerMetrics m;
+            m.thread = thread;
+            m.tasks = tasks.load(std::memory_order_relaxed);
+            m.switches = switches.load(std::memory_order_relaxed);
+            m.migrations = migrations.load(std::memory_order_relaxed);
+            m.busyUs = busyUs.load(std::memory_order_relaxed);
+            m.idleUs = idleUs.load(std::memory_order_relaxed);
+            Load(wait, m.wait);
+            Load(run, m.run);
+            return m;
+        }
+    };
 
     ////////////////////////////////////////////////////////////////////
     /// Scheduler
     ////////////////////////////////////////////////////////////////////
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
-            : m_name(name) {
+            : m_mutex("scheduler"), m_name(name), m_affinity(g_scheduler_affinity->getValue()),
+              m_maxWaitMs(g_scheduler_max_wait->getValue()),
+              m_metricsDumpMs(g_scheduler_metrics_dump->getValue()),
+              m_metricsTiming(g_scheduler_metrics_timing->getValue()) {
         MOCKER_ASSERT(threads > 0);
+        {
+            LiveSchedulers &live = GetLiveSchedulers();
+            Mutex::Lock lock(live.mutex);
+            live.schedulers.insert(this);
+        }
 
         if (use_caller) {
             Coroutine::GetCurrent();
@@ -45,6 +226,9 @@ namespace mocker {
         if (GetCurrent() == this) {
             t_scheduler = nullptr;
         }
+        LiveSchedulers &live = GetLiveSchedulers();
+        Mutex::Lock lock(live.mutex);
+        live.schedulers.erase(this);
 
     }
 
@@ -57,11 +241,24 @@ namespace mocker {
             m_stopping = false;
             MOCKER_ASSERT(m_threads.empty());
             m_threads.resize(m_threadCount);
-
+            // counters of the last run, its workers are gone
+            m_workers.clear();
+
+            Thread::Options options;
+            options.stackSize = g_scheduler_thread_stack_size->getValue();
+            options.guardSize = g_scheduler_thread_guard_size->getValue();
+            options.prefaultStack = g_scheduler_thread_prefault->getValue();
+            // create them all, then wait once for the slowest
+            options.async = true;
             for (size_t i = 0; i < m_threadCount; ++i) {
-                m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                              m_name + "_" + std::to_string(i)));
-                m_threadIds.push_back(m_threads[i]->getId());
+                m_threads[i].reset(new Thread([this, i]() {
+                    applyAffinity(i);
+                    run();
+                }, m_name + "_" + std::to_string(i), options));
+            }
+            Thread::WaitStarted(m_threads);
+            for (auto &thread : m_threads) {
+                m_threadIds.push_back(thread->getId());
             }
         }
 //        if (m_rootCoroutine) {
@@ -129,6 +326,196 @@ namespace mocker {
 //        }
     }
 
+    void Scheduler::schedule(Batch &batch) {
+        if (batch.empty()) {
+            return;
+        }
+        size_t count = batch.size();
+        uint64_t now = GetCurrentUS();
+        for (auto &coe : batch.m_tasks) {
+            coe.enqueued = now;
+        }
+        bool need_tickle = false;
+        {
+            MutexType::Lock lock(m_mutex);
+            need_tickle = m_queued == 0;
+            while (!batch.m_tasks.empty()) {
+                pushNoLock(batch.m_tasks, batch.m_tasks.begin());
+            }
+        }
+
+        tickleBatch(count, need_tickle);
+    }
+
+    std::list<Scheduler::ContextOfExecute> &Scheduler::GetSpareNodes() {
+        static thread_local std::list<ContextOfExecute> spare;
+        return spare;
+    }
+
+    void Scheduler::enqueue(ContextOfExecute &coe) {
+        if (!coe.coroutine && !coe.cb) {
+            return;
+        }
+        // a node a worker of this thread finished with, or a new one, before the lock
+        std::list<ContextOfExecute> node;
+        std::list<ContextOfExecute> &spare = GetSpareNodes();
+        if (spare.empty()) {
+            node.emplace_back();
+        } else {
+            node.splice(node.begin(), spare, spare.begin());
+        }
+        node.front() = std::move(coe);
+        node.front().enqueued = GetCurrentUS();
+
+        bool need_tickle = false;
+        {
+            MutexType::Lock lock(m_mutex);
+            need_tickle = pushNoLock(node, node.begin());
+        }
+
+        if (need_tickle) {
+            tickle();
+        }
+    }
+
+    bool Scheduler::pushNoLock(std::list<ContextOfExecute> &from, std::list<ContextOfExecute>::iterator node) {
+        bool was_empty = m_queued == 0;
+        auto &queue = m_queues[node->priority];
+        auto pos = queue.end();
+        if (node->priority == DEADLINE) {
+            // deadlines mostly come in order, search from the back
+            while (pos != queue.begin() && std::prev(pos)->deadline > node->deadline) {
+                --pos;
+            }
+        }
+        queue.splice(pos, from, node);
+        ++m_queued;
+
+        QueueStats &stats = m_queueStats[&queue - m_queues];
+        stats.maxDepth = std::max(stats.maxDepth, queue.size());
+        return was_empty;
+    }
+
+    bool Scheduler::takeNoLock(std::list<ContextOfExecute> &out, bool &tickle_me) {
+        if (m_maxWaitMs) {
+            uint64_t now = GetCurrentUS();
+            // the lowest class first, its tasks are passed over the most
+            for (int i = BACKGROUND; i > DEADLINE; --i) {
+                auto &queue = m_queues[i];
+                if (queue.empty() || now - queue.front().enqueued < m_maxWaitMs * 1000) {
+                    continue;
+                }
+                bool higher_waiting = false;
+                for (int j = DEADLINE; j < i; ++j) {
+                    higher_waiting = higher_waiting || !m_queues[j].empty();
+                }
+                if (higher_waiting && takeFromNoLock(i, out, tickle_me)) {
+                    ++m_queueStats[i].agedRuns;
+                    return true;
+                }
+            }
+        }
+
+        for (int i = DEADLINE; i < PRIORITY_COUNT; ++i) {
+            if (takeFromNoLock(i, out, tickle_me)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool Scheduler::takeFromNoLock(int queue, std::list<ContextOfExecute> &out, bool &tickle_me) {
+        auto &tasks = m_queues[queue];
+        auto it = tasks.begin();
+        while (it != tasks.end()) {
+            if (it->thread != -1 && it->thread != GetThreadId()) {
+                ++it;
+                tickle_me = true;
+                continue;
+            }
+
+            MOCKER_ASSERT(it->coroutine || it->cb);
+            if (it->coroutine && it->coroutine->getState() == Coroutine::EXEC) {
+                // still swapping out on another thread, try it again soon
+                ++it;
+                tickle_me = true;
+                continue;
+            }
+
+            out.splice(out.end(), tasks, it);
+            --m_queued;
+            ++m_queueStats[queue].runs;
+            return true;
+        }
+        return false;
+    }
+
+    Scheduler::QueueStats Scheduler::getQueueStats(Priority priority) {
+        MutexType::Lock lock(m_mutex);
+        QueueStats stats = m_queueStats[priority];
+        stats.depth = m_queues[priority].size();
+        return stats;
+    }
+
+    Scheduler::Metrics Scheduler::getMetrics() {
+        Metrics metrics;
+        metrics.name = m_name;
+        metrics.activeThreads = m_activeThreadCount;
+        metrics.idleThreads = m_idleThreadCount;
+        MutexType::Lock lock(m_mutex);
+        for (int i = 0; i < PRIORITY_COUNT; ++i) {
+            metrics.queues[i] = m_queueStats[i];
+            metrics.queues[i].depth = m_queues[i].size();
+        }
+        for (auto &worker : m_workers) {
+            metrics.workers.push_back(worker->load());
+            metrics.total.merge(metrics.workers.back());
+        }
+        return metrics;
+    }
+
+    std::shared_ptr<Scheduler::WorkerCounters> Scheduler::addWorker() {
+        auto counters = std::make_shared<WorkerCounters>(GetThreadId());
+        MutexType::Lock lock(m_mutex);
+        m_workers.push_back(counters);
+        return counters;
+    }
+
+    void Scheduler::dumpMetrics(uint64_t now) {
+        uint64_t due = m_nextDumpUs;
+        if (now < due || !m_nextDumpUs.compare_exchange_strong(due, now + m_metricsDumpMs * 1000)) {
+            return;
+        }
+        // the first time only arms the dump
+        if (due) {
+            MOCKER_LOG_INFO(g_metrics_logger) << getMetrics().toString();
+        }
+    }
+
+    void Scheduler::tickleBatch(size_t count, bool need_tickle) {
+        // a woken worker keeps pulling until the queue is empty, so there is
+        // no point in waking more workers than tasks
+        size_t wake = std::min(count, (size_t) m_idleThreadCount);
+        if (wake == 0 && need_tickle) {
+            wake = 1;
+        }
+        for (size_t i = 0; i < wake; ++i) {
+            tickle();
+        }
+    }
+
+    void Scheduler::applyAffinity(size_t index) {
+        std::vector<int> cpus = m_affinity.cpusFor(index);
+        if (!cpus.empty() && Thread::SetCurrentAffinity(cpus)) {
+            MOCKER_LOG_DEBUG(g_logger) << m_name << " worker " << index << " pinned to "
+                                       << cpus.size() << " cpus from " << cpus[0]
+                                       << " node=" << Thread::GetCurrentNumaNode();
+        }
+        if (m_affinity.nice) {
+            Thread::SetCurrentNice(m_affinity.nice);
+        }
+    }
+
     void Scheduler::tickle() {
         MOCKER_LOG_INFO(g_logger) << "tickle";
     }
@@ -136,7 +523,7 @@ namespace mocker {
     bool Scheduler::stopping() {
         MutexType::Lock lock(m_mutex);
         return m_autoStop && m_stopping
-               && m_coroutines.empty() && m_activeThreadCount == 0;
+               && m_queued == 0 && m_activeThreadCount == 0;
     }
 
     void Scheduler::idle() {
@@ -148,6 +535,7 @@ namespace mocker {
 
     void Scheduler::run() {
         MOCKER_LOG_DEBUG(g_logger) << "call run()";
+        set_hook_enable(m_hookEnable);
         setCurrent();
 
         if (GetThreadId() != m_rootThread) {
@@ -155,34 +543,26 @@ namespace mocker {
         }
 
         Coroutine::ptr idle_coroutine(new Coroutine(std::bind(&Scheduler::idle, this), false));
+        idle_coroutine->setInternal(true);
         Coroutine::ptr cb_coroutine;
+        std::shared_ptr<WorkerCounters> counters = addWorker();
 
-        ContextOfExecute coe;
+        // the node of the task taken, it goes back to the queue or to the spare nodes
+        std::list<ContextOfExecute> running;
+        bool requeue = false;
         while (true) {
-            coe.reset();
             bool tickle_me = false;
             bool is_active = false;
             {
                 MutexType::Lock lock(m_mutex);
-                auto it = m_coroutines.begin();
-                while (it != m_coroutines.end()) {
-                    if (it->thread != -1 && it->thread != GetThreadId()) {
-                        ++it;
-                        tickle_me = true;
-                        continue;
-                    }
-
-                    MOCKER_ASSERT(it->coroutine || it->cb);
-                    if (it->coroutine && it->coroutine->getState() == Coroutine::EXEC) {
-                        ++it;
-                        continue;
-                    }
-
-                    coe = *it;
-                    m_coroutines.erase(it);
+                // a yielded task goes back in its own node, under the lock taken anyway
+                if (requeue) {
+                    pushNoLock(running, running.begin());
+                    requeue = false;
+                }
+                if (takeNoLock(running, tickle_me)) {
                     ++m_activeThreadCount;
                     is_active = true;
-                    break;
                 }
             }
 
@@ -190,56 +570,92 @@ namespace mocker {
                 tickle();
             }
 
-            if (coe.coroutine && (coe.coroutine->getState() != Coroutine::TERM
-                                  && coe.coroutine->getState() != Coroutine::EXCEPT)) {
-                coe.coroutine->swapIn();
-                --m_activeThreadCount;
+            // no clock read a task unless something wants the time
+            bool timing = m_metricsTiming.load(std::memory_order_relaxed);
+            uint64_t begin = timing || m_metricsDumpMs ? GetCurrentUS() : 0;
+            if (m_metricsDumpMs) {
+                dumpMetrics(begin);
+            }
+            if (!timing) {
+                begin = 0;
+            }
 
-                if (coe.coroutine->getState() == Coroutine::READY) {
-                    schedule(coe.coroutine);
-                } else if (coe.coroutine->getState() != Coroutine::TERM
-                           && coe.coroutine->getState() != Coroutine::EXCEPT) {
-                    coe.coroutine->setState(Coroutine::HOLD);
+            if (!is_active) {
+                if (idle_coroutine->getState() == Coroutine::TERM) {
+                    MOCKER_LOG_INFO(g_logger) << "idle coroutine terminated";
+                    break;
                 }
 
-                coe.reset();
+                ++m_idleThreadCount;
+                Coroutine::State state = idle_coroutine->swapIn();
+                --m_idleThreadCount;
+                WorkerCounters::Add(counters->switches);
+                if (begin) {
+                    WorkerCounters::Add(counters->idleUs, GetCurrentUS() - begin);
+                }
+
+                if (state != Coroutine::TERM && state != Coroutine::EXCEPT) {
+                    idle_coroutine->setState(Coroutine::HOLD);
+                }
+                continue;
+            }
+
+            ContextOfExecute &coe = running.front();
+            if (begin) {
+                WorkerCounters::Add(counters->wait[Histogram::Bucket(begin - coe.enqueued)]);
+            }
+            if (coe.coroutine && (coe.coroutine->getState() != Coroutine::TERM
+                                  && coe.coroutine->getState() != Coroutine::EXCEPT)) {
+                coe.coroutine->setSchedClass(coe.priority);
+                if (coe.coroutine->getLastThread() && coe.coroutine->getLastThread() != GetThreadId()) {
+                    WorkerCounters::Add(counters->migrations);
+                }
+                /*
+                 * Once out of EXEC it may already be rescheduled and running
+                 * on another thread, so only the state swapIn returned counts.
+                 */
+                Coroutine::State state = coe.coroutine->swapIn();
+                --m_activeThreadCount;
+                counters->addRun(begin, state);
+                requeue = state == Coroutine::READY;
             } else if (coe.cb) {
                 if (cb_coroutine) {
-                    cb_coroutine->reset(coe.cb);
+                    cb_coroutine->reset(std::move(coe.cb));
                 } else {
-                    cb_coroutine.reset(new Coroutine(coe.cb, false));
+                    cb_coroutine.reset(new Coroutine(std::move(coe.cb), false));
                 }
+                coe.cb = nullptr;
+                cb_coroutine->setSchedClass(coe.priority);
 
-                coe.reset();
-                cb_coroutine->swapIn();
+                Coroutine::State state = cb_coroutine->swapIn();
                 --m_activeThreadCount;
-                if (cb_coroutine->getState() == Coroutine::READY) {
-                    schedule(cb_coroutine);
-                    cb_coroutine.reset();
-                } else if (cb_coroutine->getState() == Coroutine::EXCEPT
-                           || cb_coroutine->getState() == Coroutine::TERM) {
+                counters->addRun(begin, state);
+                if (state == Coroutine::READY) {
+                    coe.coroutine = std::move(cb_coroutine);
+                    requeue = true;
+                } else if (state == Coroutine::EXCEPT || state == Coroutine::TERM) {
                     cb_coroutine->reset(nullptr);
                 } else {
-                    // cb_coroutine->getState() != Coroutine::TERM
-                    cb_coroutine->setState(Coroutine::HOLD);
+                    // HOLD, whoever wakes it up owns it now
                     cb_coroutine.reset();
                 }
             } else {
-                if (is_active) {
-                    --m_activeThreadCount;
-                }
-                if (idle_coroutine->getState() == Coroutine::TERM) {
-                    MOCKER_LOG_INFO(g_logger) << "idle coroutine terminated";
-                    break;
-                }
-
-                ++m_idleThreadCount;
-                idle_coroutine->swapIn();
-                --m_idleThreadCount;
+                --m_activeThreadCount;
+            }
 
-                if (idle_coroutine->getState() != Coroutine::TERM
-                    && idle_coroutine->getState() != Coroutine::EXCEPT) {
-                    idle_coroutine->setState(Coroutine::HOLD);
+            if (requeue) {
+                // like schedule() of the coroutine: not pinned, no deadline any more
+                coe.thread = -1;
+                coe.priority = coe.priority == DEADLINE ? HIGH : coe.priority;
+                coe.deadline = 0;
+                coe.enqueued = GetCurrentUS();
+            } else {
+                coe.reset();
+                std::list<ContextOfExecute> &spare = GetSpareNodes();
+                if (spare.size() < s_spare_nodes) {
+                    spare.splice(spare.begin(), running, running.begin());
+                } else {
+                    running.clear();
                 }
             }
         }
@@ -257,5 +673,11 @@ namespace mocker {
         return t_coroutine;
     }
 
+    std::string Scheduler::GetNameOf(const Scheduler *scheduler) {
+        LiveSchedulers &live = GetLiveSchedulers();
+        Mutex::Lock lock(live.mutex);
+        return live.schedulers.count(scheduler) ? scheduler->m_name : "";
+    }
+
 
 }
\ No newline at end of file
@@ -5,11 +5,15 @@
 #ifndef MOCKER_SCHEDULE_H
 #define MOCKER_SCHEDULE_H
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 #include <list>
 
+#include <mocker/affinity.h>
 #include <mocker/mutex.h>
 #include <mocker/coroutine.h>
 #include <mocker/thread.h>
@@ -21,6 +25,77 @@ namespace mocker {
         typedef std::shared_ptr<Scheduler> ptr;
         typedef Mutex MutexType;
 
+        /**
+         * Scheduling classes, served in this order. DEADLINE holds the tasks
+         * of scheduleDeadline(), earliest deadline first, the others are
+         * FIFO. A task waiting longer than the max wait goes ahead of the
+         * classes above its own, so background work is delayed but never
+         * starved.
+         */
+        enum Priority {
+            DEADLINE = 0,
+            HIGH,
+            NORMAL,
+            BACKGROUND,
+            PRIORITY_COUNT
+        };
+
+        struct QueueStats {
+            // waiting now, and the most that ever waited
+            size_t depth = 0;
+            size_t maxDepth = 0;
+            // taken by a worker, and of those taken ahead of a higher class
+            uint64_t runs = 0;
+            uint64_t agedRuns = 0;
+        };
+
+        // microseconds in log2 buckets, bucket i below 2^i, the last one open ended
+        struct Histogram {
+            static const int BUCKETS = 24;
+            uint64_t counts[BUCKETS] = {};
+
+            static int Bucket(uint64_t us) {
+                return us ? std::min(64 - __builtin_clzll(us), BUCKETS - 1) : 0;
+            }
+
+            uint64_t count() const;
+
+            // upper bound of the bucket the p-th fraction falls in
+            uint64_t percentile(double p) const;
+
+            void merge(const Histogram &other);
+        };
+
+        struct WorkerMetrics {
+            pid_t thread = 0;
+            // tasks and coroutines run to TERM or EXCEPT
+            uint64_t tasks = 0;
+            // every swapIn, the idle coroutine too
+            uint64_t switches = 0;
+            // coroutines resumed on another worker than the last time
+            uint64_t migrations = 0;
+            // the times below only with the metrics timing on
+            uint64_t busyUs = 0;
+            uint64_t idleUs = 0;
+            // queued until taken, and one swapIn until it came back
+            Histogram wait;
+            Histogram run;
+
+            void merge(const WorkerMetrics &other);
+        };
+
+        struct Metrics {
+            std::string name;
+            std::vector<WorkerMetrics> workers;
+            // all workers summed up
+            WorkerMetrics total;
+            QueueStats queues[PRIORITY_COUNT];
+            size_t activeThreads = 0;
+            size_t idleThreads = 0;
+
+            std::string toString() const;
+        };
+
     public:
         explicit Scheduler(size_t threads = 1, bool use_caller = true, const std::string &name = "");
 
@@ -28,6 +103,33 @@ namespace mocker {
 
         const std::string &getName() const { return m_name; }
 
+        // takes effect on the next start(), defaults to scheduler.affinity
+        void setAffinity(const AffinityPolicy &policy) { m_affinity = policy; }
+
+        const AffinityPolicy &getAffinity() const { return m_affinity; }
+
+        // 0 turns aging off, defaults to scheduler.max_wait_ms
+        void setMaxWait(uint64_t ms) { m_maxWaitMs = ms; }
+
+        uint64_t getMaxWait() const { return m_maxWaitMs; }
+
+        QueueStats getQueueStats(Priority priority);
+
+        /**
+         * Sums up the counters every worker keeps for itself. Workers only
+         * write their own, so a snapshot taken while they run may be off by
+         * the task in flight.
+         */
+        Metrics getMetrics();
+
+        // log getMetrics() every ms through the "metrics" logger, 0 stops,
+        // defaults to scheduler.metrics_dump_ms
+        void setMetricsDump(uint64_t ms) { m_metricsDumpMs = ms; }
+
+        // time every task for the busy, idle, wait and run metrics, two clock
+        // reads a task, defaults to scheduler.metrics_timing
+        void setMetricsTiming(bool on) { m_metricsTiming = on; }
+
         void start();
 
         void stop();
@@ -37,47 +139,69 @@ namespace mocker {
          * These three functions need implement in header file, not cpp file.
          * if not, it will cause ld error "undefined reference to".
          */
+        // a coroutine goes back to the class it last ran in, anything else is NORMAL
         template<class CortOrCb>
         void schedule(CortOrCb cc, pid_t thread = -1) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                need_tickle = scheduleNoLock(cc, thread);
-            }
+            ContextOfExecute coe(std::move(cc), thread);
+            enqueue(coe);
+        }
 
-            if (need_tickle) {
-                tickle();
-            }
+        template<class CortOrCb>
+        void schedule(CortOrCb cc, Priority priority, pid_t thread = -1) {
+            ContextOfExecute coe(std::move(cc), thread);
+            coe.priority = priority == DEADLINE ? HIGH : priority;
+            enqueue(coe);
+        }
+
+        // ahead of every class, earliest deadline_ms (GetCurrentMS clock) first
+        template<class CortOrCb>
+        void scheduleDeadline(CortOrCb cc, uint64_t deadline_ms, pid_t thread = -1) {
+            ContextOfExecute coe(std::move(cc), thread);
+            coe.priority = DEADLINE;
+            coe.deadline = deadline_ms;
+            enqueue(coe);
         }
 
+        class Batch;
+
+        /*
+         * Bulk submit. The run queue nodes are built outside the lock, then
+         * each is spliced into the queue of its class under one lock
+         * acquisition, and at most min(tasks, idle threads) workers are
+         * tickled.
+         */
         template<class InputIterator>
-        void schedule(InputIterator begin, InputIterator end) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while (begin != end) {
-                    need_tickle = scheduleNoLock(&(*begin), -1) || need_tickle;
-
-                    ++begin;
-                }
-            }
+        void schedule(InputIterator begin, InputIterator end);
 
-            if (need_tickle) {
-                tickle();
-            }
-        }
+        // the batch is empty afterwards and can be filled again
+        void schedule(Batch &batch);
 
     private:
-        template<class CortOrCb>
-        bool scheduleNoLock(CortOrCb cc, pid_t thread) {
-            bool need_tickle = m_coroutines.empty();
-            ContextOfExecute coe(cc, thread);
+        struct ContextOfExecute;
 
-            if (coe.coroutine || coe.cb) {
-                m_coroutines.push_back(coe);
-            }
-            return need_tickle;
-        }
+        void enqueue(ContextOfExecute &coe);
+
+        // queue node into its class, returns whether all queues were empty
+        bool pushNoLock(std::list<ContextOfExecute> &from, std::list<ContextOfExecute>::iterator node);
+
+        // move the node of a task this thread may run to out, aged ones first
+        bool takeNoLock(std::list<ContextOfExecute> &out, bool &tickle_me);
+
+        bool takeFromNoLock(int queue, std::list<ContextOfExecute> &out, bool &tickle_me);
+
+        static std::list<ContextOfExecute> &GetSpareNodes();
+
+        void tickleBatch(size_t count, bool need_tickle);
+
+        struct WorkerCounters;
+
+        std::shared_ptr<WorkerCounters> addWorker();
+
+        // the worker that finds the dump due logs it
+        void dumpMetrics(uint64_t now);
+
+        // pin and renice worker index on its own thread
+        void applyAffinity(size_t index);
 
     protected:
         virtual void tickle();
@@ -88,6 +212,8 @@ namespace mocker {
 
         void run();
 
+        bool hasIdleThreads() { return m_idleThreadCount > 0; }
+
         void setCurrent();
 
     public:
@@ -95,16 +221,28 @@ namespace mocker {
 
         static Coroutine *GetMainCoroutine();
 
+        // name of a scheduler not destroyed yet, empty otherwise
+        static std::string GetNameOf(const Scheduler *scheduler);
+
     private:
         struct ContextOfExecute {
             Coroutine::ptr coroutine;
             Thread::task cb;
 
             pid_t thread;
+            int priority = NORMAL;
+            uint64_t deadline = 0;
+            // GetCurrentUS() when queued
+            uint64_t enqueued = 0;
 
-            ContextOfExecute(Coroutine::ptr cort, pid_t thr) : coroutine(std::move(cort)), thread(thr) {}
+            ContextOfExecute(Coroutine::ptr cort, pid_t thr) : coroutine(std::move(cort)), thread(thr) {
+                inheritPriority();
+            }
 
-            ContextOfExecute(Coroutine::ptr *cort, pid_t thr) : thread(thr) { coroutine.swap(*cort); }
+            ContextOfExecute(Coroutine::ptr *cort, pid_t thr) : thread(thr) {
+                coroutine.swap(*cort);
+                inheritPriority();
+            }
 
             ContextOfExecute(Thread::task tk, pid_t thr) : cb(std::move(tk)), thread(thr) {}
 
@@ -112,18 +250,60 @@ namespace mocker {
 
             ContextOfExecute() : thread(-1) {}
 
+            // a woken deadline task has no deadline any more, it keeps HIGH
+            void inheritPriority() {
+                if (coroutine && coroutine->getSchedClass() >= 0) {
+                    priority = coroutine->getSchedClass() == DEADLINE ? HIGH : coroutine->getSchedClass();
+                }
+            }
+
             void reset() {
                 coroutine = nullptr;
                 cb = nullptr;
                 thread = -1;
+                priority = NORMAL;
+                deadline = 0;
             }
         };
 
+    public:
+        /**
+         * Tasks prepared ahead of time for schedule(Batch &). Filling a
+         * batch allocates but takes no lock.
+         */
+        class Batch {
+            friend class Scheduler;
+        public:
+            template<class CortOrCb>
+            void add(CortOrCb cc, pid_t thread = -1) {
+                m_tasks.emplace_back(std::move(cc), thread);
+                if (!m_tasks.back().coroutine && !m_tasks.back().cb) {
+                    m_tasks.pop_back();
+                }
+            }
+
+            size_t size() const { return m_tasks.size(); }
+
+            bool empty() const { return m_tasks.empty(); }
+
+        private:
+            std::list<ContextOfExecute> m_tasks;
+        };
+
     private:
         MutexType m_mutex;
         std::vector<Thread::ptr> m_threads;
-        std::list<ContextOfExecute> m_coroutines;
+        std::list<ContextOfExecute> m_queues[PRIORITY_COUNT];
+        QueueStats m_queueStats[PRIORITY_COUNT];
+        // in all queues
+        size_t m_queued = 0;
         std::string m_name;
+        AffinityPolicy m_affinity;
+        std::atomic<uint64_t> m_maxWaitMs;
+        std::vector<std::shared_ptr<WorkerCounters>> m_workers;
+        std::atomic<uint64_t> m_metricsDumpMs;
+        std::atomic<bool> m_metricsTiming;
+        std::atomic<uint64_t> m_nextDumpUs{0};
 
         Coroutine::ptr m_rootCoroutine;
 
@@ -134,11 +314,22 @@ namespace mocker {
         std::atomic<size_t> m_idleThreadCount = {0};
         bool m_stopping = true;
         bool m_autoStop = false;
+        // workers call set_hook_enable with it
+        bool m_hookEnable = false;
         pid_t m_rootThread = 0;
 
 
     };
 
+    template<class InputIterator>
+    void Scheduler::schedule(InputIterator begin, InputIterator end) {
+        Batch batch;
+        while (begin != end) {
+            batch.add(&(*begin));
+            ++begin;
+        }
+        schedule(batch);
+    }
 
 }
 
@@ -2,7 +2,12 @@
 // Created by ChaosChen on 2021/7/18.
 //
 
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cerrno>
+
 #include <mocker/thread.h>
+#include <mocker/affinity.h>
 #include <mocker/log.h>
 #include <mocker/util.h>
 
@@ -12,6 +17,7 @@ namespace mocker {
     // Current thread local variable
     static thread_local Thread* t_thread;
     static thread_local std::string t_thread_name = "UNKNOWN";
+    static thread_local int t_numa_node = -1;
 
     static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
 
@@ -33,31 +39,96 @@ namespace mocker {
         t_thread_name = name;
     }
 
-    Thread::Thread(Thread::task cb, const std::string &name) {
+    bool Thread::SetCurrentAffinity(const std::vector<int> &cpus) {
+        if (!SetThreadAffinity(pthread_self(), cpus)) {
+            return false;
+        }
+        const CpuTopology &topo = CpuTopology::Get();
+        int node = cpus.empty() ? -1 : topo.getNodeOfCpu(cpus[0]);
+        for (int cpu : cpus) {
+            if (topo.getNodeOfCpu(cpu) != node) {
+                node = -1;
+                break;
+            }
+        }
+        t_numa_node = node;
+        return true;
+    }
+
+    int Thread::GetCurrentNumaNode() {
+        return t_numa_node;
+    }
+
+    bool Thread::SetCurrentNice(int nice) {
+        if (setpriority(PRIO_PROCESS, GetThreadId(), nice)) {
+            MOCKER_LOG_ERROR(g_logger) << "setpriority " << nice << " fail, errno=" << errno
+                                       << " name=" << t_thread_name;
+            return false;
+        }
+        return true;
+    }
+
+    Thread::Thread(Thread::task cb, const std::string &name)
+            : Thread(std::move(cb), name, Options()) {
+    }
+
+    Thread::Thread(Thread::task cb, const std::string &name, const Options &options) {
         m_cb = std::move(cb);
+        m_prefault = options.prefaultStack;
 
         if (name.empty()) {
             m_name = "UNKNOWN";
         } else {
             m_name = name;
         }
-        int r = pthread_create(&m_thread, nullptr, &Thread::Run, this);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        int r = 0;
+        if (options.stackSize) {
+            r = pthread_attr_setstacksize(&attr, options.stackSize);
+        }
+        if (!r && options.guardSize) {
+            r = pthread_attr_setguardsize(&attr, options.guardSize);
+        }
+        if (!r) {
+            r = pthread_create(&m_thread, &attr, &Thread::Run, this);
+        }
+        pthread_attr_destroy(&attr);
 
         if (r) {
             MOCKER_LOG_ERROR(g_logger) << "pthread_create thread fail, r=" << r
-                << " name=" << name;
+                << " name=" << name << " stack_size=" << options.stackSize
+                << " guard_size=" << options.guardSize;
             throw std::logic_error("pthread_create error");
         }
 
-        m_semaphore.wait();
+        if (!options.async) {
+            waitStarted();
+        }
     }
 
     Thread::~Thread() {
+        waitStarted();
         if (m_thread) {
             pthread_detach(m_thread);
         }
     }
 
+    void Thread::waitStarted() {
+        if (!m_started) {
+            m_semaphore.wait();
+            m_started = true;
+        }
+    }
+
+    void Thread::WaitStarted(const std::vector<Thread::ptr> &threads) {
+        // they all run already, the waits overlap
+        for (auto &thread : threads) {
+            thread->waitStarted();
+        }
+    }
+
     void Thread::join() {
         if (m_thread) {
             int r = pthread_join(m_thread, nullptr);
@@ -70,6 +141,25 @@ namespace mocker {
         }
     }
 
+    void Thread::PrefaultStack() {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr)) {
+            return;
+        }
+        void *addr;
+        size_t size;
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+
+        // the lowest usable byte up to a margin below this frame, the guard is below addr
+        char *low = (char *) addr;
+        char *high = (char *) __builtin_frame_address(0) - 4096;
+        long page = sysconf(_SC_PAGESIZE);
+        for (char *p = low; p < high; p += page) {
+            *(volatile char *) p = 0;
+        }
+    }
+
     void * Thread::Run(void *arg) {
         auto* thread = (Thread*)arg;
         t_thread = thread;
@@ -81,6 +171,9 @@ namespace mocker {
         Thread::task cb;
         cb.swap(thread->m_cb);
 
+        if (thread->m_prefault) {
+            PrefaultStack();
+        }
         thread->m_semaphore.notify();
 
         cb();
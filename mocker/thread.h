@@ -8,6 +8,8 @@
 #include <thread>
 #include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <mocker/mutex.h>
 
@@ -18,18 +20,43 @@ namespace mocker {
         typedef std::shared_ptr<Thread> ptr;
         typedef std::function<void()> task;
 
+        struct Options {
+            // 0 keeps the pthread defaults, 8 MiB of stack and a page of guard
+            size_t stackSize = 0;
+            size_t guardSize = 0;
+            // touch the whole stack before cb runs, no page faults later
+            bool prefaultStack = false;
+            // return right after pthread_create, see waitStarted()
+            bool async = false;
+        };
+
         Thread(Thread::task cb, const std::string& name = "");
+        Thread(Thread::task cb, const std::string& name, const Options& options);
+        // waits for the start of an async thread, it still uses this object
         ~Thread();
 
         pid_t getId() const { return m_id; }
         const std::string& getName() const { return m_name; }
 
+        // wait until the thread runs, getId() is valid from then on
+        void waitStarted();
+
+        // start threads with async first, then wait for all of them here
+        static void WaitStarted(const std::vector<Thread::ptr>& threads);
+
         void join();
 
         static Thread* GetCurrent();
         static const std::string& GetCurrentName();
         static void SetCurrentName(const std::string& name);
 
+        // pin the calling thread, false if the kernel refuses
+        static bool SetCurrentAffinity(const std::vector<int>& cpus);
+        // node the calling thread is pinned to, -1 if it may run on several
+        static int GetCurrentNumaNode();
+        // nice value of the calling thread, lower runs first
+        static bool SetCurrentNice(int nice);
+
     public:
         Thread(const Thread&) = delete;
         Thread(const Thread&&) = delete;
@@ -37,11 +64,15 @@ namespace mocker {
 
     private:
         static void* Run(void* arg);
+
+        static void PrefaultStack();
     private:
         pid_t m_id = -1;
         pthread_t m_thread = 0;
         Thread::task m_cb;
         std::string m_name;
+        bool m_prefault = false;
+        bool m_started = false;
 
         Semaphore m_semaphore;
     };
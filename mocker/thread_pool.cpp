@@ -0,0 +1,205 @@
+#include <mocker/log.h>
+#include <mocker/macro.h>
+#include <mocker/thread_pool.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    static thread_local ThreadPool *t_pool = nullptr;
+
+    ThreadPool::ThreadPool(size_t min_threads, size_t max_threads, size_t queue_size,
+                           const std::string &name, uint64_t idle_ms)
+            : m_name(name),
+              m_minThreads(min_threads),
+              m_maxThreads(std::max(min_threads, max_threads)),
+              m_idleMs(idle_ms),
+              m_slots(queue_size) {
+        MOCKER_ASSERT(m_maxThreads > 0 && queue_size > 0);
+        Mutex::Lock lock(m_mutex);
+        for (size_t i = 0; i < m_minThreads; ++i) {
+            spawn();
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        stop();
+    }
+
+    ThreadPool *ThreadPool::GetCurrent() {
+        return t_pool;
+    }
+
+    size_t ThreadPool::getThreadCount() const {
+        Mutex::Lock lock(m_mutex);
+        return m_threads.size();
+    }
+
+    bool ThreadPool::push(task cb, bool block) {
+        if (block) {
+            m_slots.wait();
+        } else if (!m_slots.tryWait()) {
+            return false;
+        }
+        {
+            Mutex::Lock lock(m_mutex);
+            if (m_stopping) {
+                m_slots.notify();
+                MOCKER_LOG_ERROR(g_logger) << "ThreadPool " << m_name << " is stopped, task refused";
+                throw std::logic_error("ThreadPool stopped");
+            }
+            m_tasks.push_back(std::move(cb));
+            // everybody busy, grow if allowed
+            if (m_tasks.size() > m_idle && m_threads.size() < m_maxThreads) {
+                spawn();
+            }
+        }
+        m_items.notify();
+        return true;
+    }
+
+    bool ThreadPool::runOne() {
+        if (!m_items.tryWait()) {
+            return false;
+        }
+        task cb;
+        {
+            Mutex::Lock lock(m_mutex);
+            if (!m_tasks.empty()) {
+                cb.swap(m_tasks.front());
+                m_tasks.pop_front();
+            }
+        }
+        if (!cb) {
+            // a permit meant to stop a thread
+            m_items.notify();
+            return false;
+        }
+        m_slots.notify();
+        cb();
+        return true;
+    }
+
+    void ThreadPool::parallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &f,
+                                 size_t grain) {
+        std::vector<Future<void>> futures;
+        for (auto &chunk : split(begin, end, grain)) {
+            auto state = std::make_shared<FutureState<void>>();
+            auto run = [state, chunk, &f]() {
+                auto call = [&f, &chunk]() {
+                    f(chunk.first, chunk.second);
+                };
+                state->run(call);
+            };
+            if (!push(run, false)) {
+                run();
+            }
+            futures.emplace_back(state);
+        }
+        help(futures);
+        for (auto &future : futures) {
+            future.get();
+        }
+    }
+
+    std::vector<std::pair<size_t, size_t>> ThreadPool::split(size_t begin, size_t end, size_t grain) const {
+        std::vector<std::pair<size_t, size_t>> chunks;
+        if (begin >= end) {
+            return chunks;
+        }
+        // a few chunks per thread evens out uneven ones
+        size_t count = std::min((end - begin + grain - 1) / std::max<size_t>(grain, 1), m_maxThreads * 4);
+        count = std::max<size_t>(count, 1);
+        size_t size = (end - begin) / count;
+        size_t rest = (end - begin) % count;
+        for (size_t i = 0; i < count; ++i) {
+            size_t next = begin + size + (i < rest ? 1 : 0);
+            chunks.emplace_back(begin, next);
+            begin = next;
+        }
+        return chunks;
+    }
+
+    void ThreadPool::spawn() {
+        for (auto &thread : m_exited) {
+            thread->join();
+        }
+        m_exited.clear();
+        m_threads.emplace_back(new Thread(std::bind(&ThreadPool::run, this),
+                                          m_name + "_" + std::to_string(m_nextId++)));
+    }
+
+    void ThreadPool::run() {
+        t_pool = this;
+        while (true) {
+            bool woken;
+            bool elastic;
+            {
+                Mutex::Lock lock(m_mutex);
+                ++m_idle;
+                elastic = m_threads.size() > m_minThreads;
+            }
+            if (elastic) {
+                woken = m_items.waitFor(m_idleMs);
+            } else {
+                m_items.wait();
+                woken = true;
+            }
+
+            task cb;
+            {
+                Mutex::Lock lock(m_mutex);
+                --m_idle;
+                if (!woken) {
+                    // idle too long, unless the pool shrank meanwhile
+                    if (m_threads.size() > m_minThreads && !m_stopping) {
+                        for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+                            if (it->get() == Thread::GetCurrent()) {
+                                m_exited.push_back(*it);
+                                m_threads.erase(it);
+                                break;
+                            }
+                        }
+                        return;
+                    }
+                    continue;
+                }
+                if (m_tasks.empty()) {
+                    // woken by stop()
+                    return;
+                }
+                cb.swap(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            m_slots.notify();
+            cb();
+        }
+    }
+
+    void ThreadPool::stop() {
+        std::list<Thread::ptr> threads;
+        {
+            Mutex::Lock lock(m_mutex);
+            if (m_stopping) {
+                return;
+            }
+            m_stopping = true;
+            threads = m_threads;
+        }
+        MOCKER_ASSERT(t_pool != this);
+        // a thread takes the queued tasks before its stop permit, they are behind them
+        for (size_t i = 0; i < threads.size(); ++i) {
+            m_items.notify();
+        }
+        for (auto &thread : threads) {
+            thread->join();
+        }
+
+        Mutex::Lock lock(m_mutex);
+        for (auto &thread : m_exited) {
+            thread->join();
+        }
+        m_exited.clear();
+        MOCKER_ASSERT(m_tasks.empty());
+    }
+
+}
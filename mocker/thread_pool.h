@@ -0,0 +1,255 @@
+#ifndef MOCKER_THREAD_POOL_H
+#define MOCKER_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <mocker/mutex.h>
+#include <mocker/thread.h>
+
+namespace mocker {
+
+    ////////////////////////////////////////////////////////////////////
+    /// Future
+    ////////////////////////////////////////////////////////////////////
+    class FutureStateBase {
+    public:
+        bool isReady() const {
+            return m_ready.load(std::memory_order_acquire);
+        }
+
+        // blocks the thread, the permit is passed on to the next waiter
+        void wait() {
+            if (!isReady()) {
+                m_done.wait();
+                m_done.notify();
+            }
+        }
+
+    protected:
+        void finish(std::exception_ptr error) {
+            m_error = error;
+            m_ready.store(true, std::memory_order_release);
+            m_done.notify();
+        }
+
+        void rethrow() {
+            if (m_error) {
+                std::rethrow_exception(m_error);
+            }
+        }
+
+    private:
+        Semaphore m_done;
+        std::atomic<bool> m_ready{false};
+        std::exception_ptr m_error;
+    };
+
+    template<class T>
+    class FutureState : public FutureStateBase {
+    public:
+        template<class F>
+        void run(F &f) {
+            try {
+                m_value.reset(new T(f()));
+                finish(nullptr);
+            } catch (...) {
+                finish(std::current_exception());
+            }
+        }
+
+        T &get() {
+            wait();
+            rethrow();
+            return *m_value;
+        }
+
+    private:
+        std::unique_ptr<T> m_value;
+    };
+
+    template<>
+    class FutureState<void> : public FutureStateBase {
+    public:
+        template<class F>
+        void run(F &f) {
+            try {
+                f();
+                finish(nullptr);
+            } catch (...) {
+                finish(std::current_exception());
+            }
+        }
+
+        void get() {
+            wait();
+            rethrow();
+        }
+    };
+
+    /**
+     * Result of a task submitted to a ThreadPool. get() blocks the calling
+     * thread until the task ran and rethrows what the task threw. Copies
+     * share the result.
+     */
+    template<class T>
+    class Future {
+    public:
+        typedef std::shared_ptr<FutureState<T>> StatePtr;
+
+        Future() = default;
+
+        explicit Future(StatePtr state) : m_state(std::move(state)) {}
+
+        bool valid() const { return (bool) m_state; }
+
+        bool isReady() const { return m_state->isReady(); }
+
+        void wait() const { m_state->wait(); }
+
+        typename std::add_lvalue_reference<T>::type get() const { return m_state->get(); }
+
+    private:
+        StatePtr m_state;
+    };
+
+    ////////////////////////////////////////////////////////////////////
+    /// ThreadPool
+    ////////////////////////////////////////////////////////////////////
+    /**
+     * Plain threads for cpu work, unlike a Scheduler nothing runs in a
+     * coroutine: a task blocking blocks its thread. min_threads start right
+     * away; with max_threads above that, more are started while all of them
+     * are busy, and those exit again after idle_ms without work. submit()
+     * blocks while queue_size tasks are waiting.
+     */
+    class ThreadPool {
+    public:
+        typedef std::shared_ptr<ThreadPool> ptr;
+        typedef std::function<void()> task;
+
+        ThreadPool(size_t min_threads, size_t max_threads = 0, size_t queue_size = 1024,
+                   const std::string &name = "pool", uint64_t idle_ms = 10000);
+
+        // stop()
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        template<class F>
+        Future<typename std::result_of<F()>::type> submit(F f) {
+            typedef typename std::result_of<F()>::type R;
+            auto state = std::make_shared<FutureState<R>>();
+            push([state, f]() mutable {
+                state->run(f);
+            }, true);
+            return Future<R>(state);
+        }
+
+        /**
+         * Run f(chunk_begin, chunk_end) over [begin, end) cut in chunks of at
+         * least grain, on the pool and the calling thread. Returns when all
+         * chunks ran, rethrows the first exception of a chunk.
+         */
+        void parallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &f,
+                         size_t grain = 1);
+
+        // reduce(init, map(chunk)) over the chunks in order, like parallelFor
+        template<class T>
+        T parallelReduce(size_t begin, size_t end, T init, const std::function<T(size_t, size_t)> &map,
+                         const std::function<T(const T &, const T &)> &reduce, size_t grain = 1) {
+            std::vector<Future<T>> futures;
+            for (auto &chunk : split(begin, end, grain)) {
+                auto state = std::make_shared<FutureState<T>>();
+                auto run = [state, chunk, &map]() {
+                    auto f = [&map, &chunk]() {
+                        return map(chunk.first, chunk.second);
+                    };
+                    state->run(f);
+                };
+                // the calling thread takes the chunks that do not fit in the queue
+                if (!push(run, false)) {
+                    run();
+                }
+                futures.emplace_back(state);
+            }
+            help(futures);
+            for (auto &future : futures) {
+                init = reduce(init, future.get());
+            }
+            return init;
+        }
+
+        /**
+         * Refuse new tasks, let the queued ones run, and join every thread.
+         * Must not be called from a thread of the pool.
+         */
+        void stop();
+
+        const std::string &getName() const { return m_name; }
+
+        size_t getThreadCount() const;
+
+        // the pool running the calling thread, nullptr outside of one
+        static ThreadPool *GetCurrent();
+
+    private:
+        // false if block is false and the queue is full
+        bool push(task cb, bool block);
+
+        // pop and run one queued task without waiting, false if none
+        bool runOne();
+
+        // wait for futures, running queued tasks meanwhile: chunks of a
+        // parallelFor called from a pool thread never wait for that thread
+        template<class T>
+        void help(std::vector<Future<T>> &futures) {
+            for (auto &future : futures) {
+                while (!future.isReady()) {
+                    if (!runOne()) {
+                        future.wait();
+                    }
+                }
+            }
+        }
+
+        std::vector<std::pair<size_t, size_t>> split(size_t begin, size_t end, size_t grain) const;
+
+        // with m_mutex held
+        void spawn();
+
+        void run();
+
+    private:
+        std::string m_name;
+        size_t m_minThreads;
+        size_t m_maxThreads;
+        uint64_t m_idleMs;
+
+        mutable Mutex m_mutex;
+        std::deque<task> m_tasks;
+        std::list<Thread::ptr> m_threads;
+        // idle threads that exited, joined by the next spawn() or stop()
+        std::vector<Thread::ptr> m_exited;
+        size_t m_idle = 0;
+        size_t m_nextId = 0;
+        bool m_stopping = false;
+
+        // one permit per queued task, and one per thread to stop
+        Semaphore m_items;
+        // free places in the queue
+        Semaphore m_slots;
+    };
+
+}
+
+#endif //MOCKER_THREAD_POOL_H
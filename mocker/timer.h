@@ -0,0 +1,85 @@
+#ifndef MOCKER_TIMER_H
+#define MOCKER_TIMER_H
+
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <set>
+#include <vector>
+
+#include <mocker/mutex.h>
+
+namespace mocker {
+
+    class TimerManager;
+
+    class Timer : public std::enable_shared_from_this<Timer> {
+        friend class TimerManager;
+    public:
+        typedef std::shared_ptr<Timer> ptr;
+
+        bool cancel();
+
+        // restart the timer from now with the same interval
+        bool refresh();
+
+        bool reset(uint64_t ms, bool from_now);
+
+    private:
+        Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager);
+
+        // only used as the key of a search
+        explicit Timer(uint64_t next);
+
+    private:
+        bool m_recurring = false;
+        uint64_t m_ms = 0;          // interval
+        uint64_t m_next = 0;        // absolute expire time, ms on the monotonic clock
+        std::function<void()> m_cb;
+        TimerManager *m_manager = nullptr;
+
+    private:
+        struct Comparator {
+            bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
+        };
+    };
+
+
+    class TimerManager {
+        friend class Timer;
+    public:
+        typedef RWMutex RWMutexType;
+
+        TimerManager();
+
+        virtual ~TimerManager();
+
+        Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+
+        // cb only runs while weak_cond is still alive
+        Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
+                                     std::weak_ptr<void> weak_cond, bool recurring = false);
+
+        // ms to the next timer, ~0ull if there is none
+        uint64_t getNextTimer();
+
+        void listExpiredCb(std::vector<std::function<void()>> &cbs);
+
+        bool hasTimer();
+
+    protected:
+        // a timer became the earliest one, the waiting loop must wake up
+        virtual void onTimerInsertedAtFront() = 0;
+
+        void addTimer(Timer::ptr val, RWMutexType::WriteLock &lock);
+
+    private:
+        RWMutexType m_mutex;
+        std::set<Timer::ptr, Timer::Comparator> m_timers;
+        // cleared by getNextTimer under the read lock
+        std::atomic<bool> m_tickled{false};
+    };
+
+}
+
+#endif //MOCKER_TIMER_H
@@ -3,6 +3,7 @@
 //
 
 #include <execinfo.h>
+#include <ctime>
 
 #include <mocker/log.h>
 #include <mocker/util.h>
@@ -50,5 +51,16 @@ namespace mocker {
         }
         return ss.str();
     }
-}
 
+    uint64_t GetCurrentMS() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+    }
+
+    uint64_t GetCurrentUS() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+    }
+}
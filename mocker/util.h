@@ -19,6 +19,10 @@ namespace mocker {
 
     void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
     std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "\t");
+
+    // monotonic clock
+    uint64_t GetCurrentMS();
+    uint64_t GetCurrentUS();
 }
 
 #endif //MOCKER_UTIL_H
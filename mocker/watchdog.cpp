@@ -0,0 +1,60 @@
+#include <algorithm>
+
+#include <mocker/log.h>
+#include <mocker/watchdog.h>
+
+namespace mocker {
+    static Logger::ptr g_logger = MOCKER_LOG_SYSTEM();
+
+    CoroutineWatchdog::CoroutineWatchdog(uint64_t exec_ms, uint64_t interval_ms)
+            : m_execMs(exec_ms), m_intervalMs(interval_ms ? interval_ms : std::max<uint64_t>(exec_ms / 2, 1)) {
+        m_handler = [](const CoroutineRegistry::Info &info) {
+            MOCKER_LOG_WARN(g_logger) << "coroutine id=" << info.id << " in EXEC for "
+                                      << info.stateUs / 1000 << "ms, blocking thread " << info.thread
+                                      << " of scheduler " << info.scheduler
+                                      << (info.created.empty() ? "" : ", created at:\n") << info.created;
+        };
+    }
+
+    CoroutineWatchdog::~CoroutineWatchdog() {
+        stop();
+    }
+
+    void CoroutineWatchdog::start() {
+        if (m_thread) {
+            return;
+        }
+        m_thread.reset(new Thread(std::bind(&CoroutineWatchdog::run, this), "watchdog"));
+    }
+
+    void CoroutineWatchdog::stop() {
+        if (!m_thread) {
+            return;
+        }
+        m_stop.notify();
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    void CoroutineWatchdog::run() {
+        while (!m_stop.waitFor(m_intervalMs)) {
+            check();
+        }
+    }
+
+    void CoroutineWatchdog::check() {
+        std::map<uint64_t, uint64_t> reported;
+        for (auto &info : CoroutineRegistry::GetStuck(m_execMs * 1000)) {
+            reported[info.id] = info.since;
+            auto it = m_reported.find(info.id);
+            if (it != m_reported.end() && it->second == info.since) {
+                continue;
+            }
+            ++m_reports;
+            m_handler(info);
+        }
+        // runs that ended are forgotten
+        m_reported.swap(reported);
+    }
+
+}
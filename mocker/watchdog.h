@@ -0,0 +1,65 @@
+#ifndef MOCKER_WATCHDOG_H
+#define MOCKER_WATCHDOG_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+
+#include <mocker/coroutine.h>
+#include <mocker/mutex.h>
+#include <mocker/thread.h>
+
+namespace mocker {
+
+    /**
+     * Reports coroutines that stay in EXEC for exec_ms or longer. A worker
+     * only gets back to its queue when the coroutine it runs yields, so one
+     * that long in EXEC blocks the worker and every task queued behind it:
+     * a busy loop, or a blocking call the hooks do not cover. A thread looks
+     * through the CoroutineRegistry every interval_ms, and each such run is
+     * handed to the handler once; the default handler logs a warning.
+     */
+    class CoroutineWatchdog {
+    public:
+        typedef std::shared_ptr<CoroutineWatchdog> ptr;
+        typedef std::function<void(const CoroutineRegistry::Info &)> Handler;
+
+        // interval_ms 0 checks every exec_ms / 2
+        explicit CoroutineWatchdog(uint64_t exec_ms, uint64_t interval_ms = 0);
+
+        ~CoroutineWatchdog();
+
+        CoroutineWatchdog(const CoroutineWatchdog &) = delete;
+        CoroutineWatchdog &operator=(const CoroutineWatchdog &) = delete;
+
+        // before start()
+        void setHandler(Handler handler) { m_handler = std::move(handler); }
+
+        void start();
+
+        void stop();
+
+        // stuck runs handed to the handler so far
+        uint64_t getReportCount() const { return m_reports; }
+
+    private:
+        void run();
+
+        void check();
+
+    private:
+        uint64_t m_execMs;
+        uint64_t m_intervalMs;
+        Handler m_handler;
+        Thread::ptr m_thread;
+        // stop() notifies it
+        Semaphore m_stop;
+        std::atomic<uint64_t> m_reports{0};
+        // id to the start of the run reported last
+        std::map<uint64_t, uint64_t> m_reported;
+    };
+
+}
+
+#endif //MOCKER_WATCHDOG_H
@@ -0,0 +1,78 @@
+#include <sched.h>
+#include <sys/time.h>
+#include <iostream>
+#include <random>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+// every worker reports where it runs
+void test_policy(const std::string &yaml) {
+    mocker::Config::LoadFromYaml(YAML::Load(yaml));
+    mocker::IOManager iom(4, false, "affinity", false);
+    MOCKER_LOG_INFO(g_logger) << "policy " << mocker::LexicalCast<mocker::AffinityPolicy, std::string>()(
+            iom.getAffinity());
+    for (int i = 0; i < 8; ++i) {
+        iom.schedule([]() {
+            MOCKER_LOG_INFO(g_logger) << mocker::Thread::GetCurrentName() << " cpu=" << sched_getcpu()
+                                      << " node=" << mocker::Thread::GetCurrentNumaNode();
+        });
+    }
+}
+
+/*
+ * Pointer chasing over a buffer bigger than the LLC, placed on mem_node
+ * while the thread runs on cpu_node. Returns ns per access.
+ */
+double chase(int cpu_node, int mem_node) {
+    const size_t size = 64 * 1024 * 1024;
+    const size_t count = size / sizeof(size_t);
+    const size_t steps = 10 * 1000 * 1000;
+
+    mocker::Thread::SetCurrentAffinity(mocker::CpuTopology::Get().getNodeCpus(cpu_node));
+    auto *buf = (size_t *) mocker::NumaAlloc(size, mem_node);
+
+    // one random cycle through all slots
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937(42));
+    for (size_t i = 0; i < count; ++i) {
+        buf[order[i]] = order[(i + 1) % count];
+    }
+
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    size_t pos = 0;
+    for (size_t i = 0; i < steps; ++i) {
+        pos = buf[pos];
+    }
+    gettimeofday(&t2, nullptr);
+    mocker::NumaFree(buf, size, mem_node);
+
+    MOCKER_ASSERT(pos < count);
+    double us = (t2.tv_sec - t1.tv_sec) * 1000000.0 + (t2.tv_usec - t1.tv_usec);
+    return us * 1000 / steps;
+}
+
+int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::WARN);
+
+    test_policy("scheduler:\n  affinity:\n    policy: compact");
+    test_policy("scheduler:\n  affinity:\n    policy: scatter");
+    test_policy("scheduler:\n  affinity:\n    policy: numa\n    node: 0");
+    test_policy("scheduler:\n  affinity:\n    policy: list\n    cpus: [0]\n    nice: 5");
+
+    int nodes = mocker::CpuTopology::Get().getNodeCount();
+    for (int c = 0; c < nodes; ++c) {
+        for (int m = 0; m < nodes; ++m) {
+            std::cout << "cpu node " << c << " memory node " << m << ": "
+                      << chase(c, m) << " ns/access" << std::endl;
+        }
+    }
+    // 1 cpu, 1 node, -O0, there is no remote node to compare with here
+    // cpu node 0 memory node 0: 200.642 ns/access
+    return 0;
+}
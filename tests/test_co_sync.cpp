@@ -0,0 +1,151 @@
+#include <sys/time.h>
+#include <iostream>
+#include <list>
+#include <stdexcept>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+static const int s_loop = 1000;
+
+template<class MutexType>
+void contend(MutexType &mutex, int &count, bool yield_in_lock) {
+    for (int i = 0; i < s_loop; ++i) {
+        typename MutexType::Lock lock(mutex);
+        ++count;
+        if (yield_in_lock && i % 10 == 0) {
+            mocker::Coroutine::Yield();
+        }
+        lock.unlock();
+        if (i % 10 == 5) {
+            mocker::Coroutine::Yield();
+        }
+    }
+}
+
+/*
+ * N coroutines on M threads contend on one lock. A pthread lock can not be
+ * held across a yield, another coroutine on the same thread would deadlock.
+ */
+template<class MutexType>
+double bench(const std::string &name, int coroutines, int threads, bool yield_in_lock) {
+    MutexType mutex;
+    int count = 0;
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    {
+        mocker::IOManager iom(threads, false, name, false);
+        for (int i = 0; i < coroutines; ++i) {
+            iom.schedule([&mutex, &count, yield_in_lock]() {
+                contend(mutex, count, yield_in_lock);
+            });
+        }
+    }
+    gettimeofday(&t2, nullptr);
+    MOCKER_ASSERT(count == coroutines * s_loop);
+    return (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.0;
+}
+
+// a bounded queue from a CoCondVar, its size limited by a CoSemaphore
+void test_producer_consumer() {
+    mocker::CoMutex mutex;
+    mocker::CoCondVar cond;
+    mocker::CoSemaphore slots(4);
+    std::list<int> queue;
+    long sum = 0;
+    {
+        mocker::IOManager iom(2, false, "pc", false);
+        for (int p = 0; p < 4; ++p) {
+            iom.schedule([&, p]() {
+                for (int i = 1; i <= 1000; ++i) {
+                    slots.wait();
+                    mocker::CoMutex::Lock lock(mutex);
+                    queue.push_back(i);
+                    cond.notify();
+                }
+            });
+        }
+        for (int c = 0; c < 2; ++c) {
+            iom.schedule([&]() {
+                for (int i = 0; i < 2000; ++i) {
+                    mocker::CoMutex::Lock lock(mutex);
+                    while (queue.empty()) {
+                        cond.wait(mutex);
+                    }
+                    sum += queue.front();
+                    queue.pop_front();
+                    lock.unlock();
+                    slots.notify();
+                }
+            });
+        }
+    }
+    MOCKER_LOG_INFO(g_logger) << "producer consumer sum=" << sum << " expect=" << 4 * 500500;
+}
+
+// a parent coroutine fans out, parks in join, and sees the first failure
+void test_task_group() {
+    std::atomic<int> finished{0}, started{0}, skipped{0};
+    std::atomic<long> sum{0};
+    mocker::IOManager iom(2, false, "group", false);
+    mocker::CoWaitGroup parent_done;
+    parent_done.add();
+    iom.schedule([&]() {
+        mocker::TaskGroup group;
+        for (int i = 1; i <= 100; ++i) {
+            group.spawn([&sum, &finished, i]() {
+                mocker::Coroutine::Yield();
+                sum += i;
+                ++finished;
+            });
+        }
+        group.join();
+        MOCKER_ASSERT(finished == 100 && sum == 5050);
+
+        // the first one fails, the others stop at their next check
+        mocker::TaskGroup failing;
+        for (int i = 0; i < 100; ++i) {
+            failing.spawn([&failing, &started, &skipped, i]() {
+                ++started;
+                if (i == 0) {
+                    throw std::runtime_error("task 0 failed");
+                }
+                for (int j = 0; j < 100; ++j) {
+                    if (failing.getToken()->isCancelled()) {
+                        ++skipped;
+                        return;
+                    }
+                    mocker::Coroutine::Yield();
+                }
+            });
+        }
+        try {
+            failing.join();
+            MOCKER_ASSERT(false);
+        } catch (std::runtime_error &e) {
+            MOCKER_LOG_WARN(g_logger) << "join rethrew \"" << e.what() << "\", " << 100 - started
+                                      << " tasks never ran, " << skipped << " stopped early";
+        }
+        parent_done.done();
+    });
+    // outside a scheduler the thread blocks
+    parent_done.wait();
+}
+
+int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::WARN);
+
+    test_producer_consumer();
+    test_task_group();
+
+    std::cout << "100 coroutines x " << s_loop << " lock/unlock on 4 threads: "
+              << "Mutex = " << bench<mocker::Mutex>("mutex", 100, 4, false)
+              << " Spinlock = " << bench<mocker::Spinlock>("spin", 100, 4, false)
+              << " CoMutex = " << bench<mocker::CoMutex>("co", 100, 4, false)
+              << " CoMutex yield in lock = " << bench<mocker::CoMutex>("co_yield", 100, 4, true)
+              << std::endl;
+    // 1 cpu, -O0, CoMutex varies with how often a holder is preempted
+    // Mutex = 0.029 Spinlock = 0.029 CoMutex = 0.033 ~ 0.40 CoMutex yield in lock = 0.60
+    return 0;
+}
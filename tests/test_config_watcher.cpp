@@ -0,0 +1,105 @@
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+static mocker::ConfigVar<int>::ptr g_port =
+        mocker::Config::Lookup("watch.port", 0, "watched port");
+
+static mocker::ConfigVar<std::string>::ptr g_name =
+        mocker::Config::Lookup("watch.name", std::string("v0"), "always v<port>");
+
+static mocker::ConfigVar<int>::ptr g_level =
+        mocker::Config::Lookup("watch.level", 0, "set by app.yml and overridden by zz.yml");
+
+// write a temporary file and rename it, like most editors do
+void write_config(const std::string &dir, int port) {
+    std::string tmp = dir + "/.app.yml.tmp";
+    {
+        std::ofstream ofs(tmp);
+        ofs << "watch:\n  port: " << port << "\n  name: v" << port << "\n  level: 1\n";
+    }
+    rename(tmp.c_str(), (dir + "/app.yml").c_str());
+}
+
+// ms until watch.port shows port
+uint64_t wait_for(int port) {
+    uint64_t begin = mocker::GetCurrentMS();
+    while (g_port->getValue() != port) {
+        usleep(1000);
+    }
+    return mocker::GetCurrentMS() - begin;
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/mocker_watch_XXXXXX";
+    MOCKER_ASSERT(mkdtemp(dir));
+    write_config(dir, 1);
+
+    g_port->addListener([](const int &old_value, const int &new_value) {
+        MOCKER_LOG_INFO(g_logger) << "watch.port " << old_value << " -> " << new_value
+                                  << " on " << mocker::Thread::GetCurrentName();
+    });
+
+    mocker::ConfigWatcher watcher(dir, 50);
+    MOCKER_ASSERT(watcher.start());
+    MOCKER_ASSERT(g_port->getValue() == 1 && g_name->getValue() == "v1");
+
+    // port and name change together, a reader must never see them apart
+    std::atomic<bool> stop{false};
+    long reads = 0;
+    mocker::Thread reader([&stop, &reads]() {
+        while (!stop) {
+            int port;
+            std::string name;
+            mocker::Config::ReadConsistent([&port, &name]() {
+                port = g_port->getValue();
+                name = g_name->getValue();
+            });
+            MOCKER_ASSERT2(name == "v" + std::to_string(port), name + " " + std::to_string(port));
+            ++reads;
+        }
+    }, "reader");
+
+    // a burst of 50 saves, 2ms apart, debounced into few reloads
+    uint64_t reloads = watcher.getReloadCount();
+    for (int i = 2; i <= 51; ++i) {
+        write_config(dir, i);
+        usleep(2000);
+    }
+    uint64_t burst_ms = wait_for(51);
+    uint64_t burst_reloads = watcher.getReloadCount() - reloads;
+
+    write_config(dir, 100);
+    uint64_t single_ms = wait_for(100);
+
+    // a later file keeps winning when an earlier one is saved again
+    std::string zz = std::string(dir) + "/zz.yml";
+    {
+        std::ofstream ofs(zz);
+        ofs << "watch:\n  level: 2\n";
+    }
+    while (g_level->getValue() != 2) {
+        usleep(1000);
+    }
+    write_config(dir, 101);
+    wait_for(101);
+    MOCKER_ASSERT(g_level->getValue() == 2);
+
+    stop = true;
+    reader.join();
+    watcher.stop();
+    unlink((std::string(dir) + "/app.yml").c_str());
+    unlink(zz.c_str());
+    rmdir(dir);
+
+    MOCKER_LOG_INFO(g_logger) << "burst of 50 saves: " << burst_reloads << " reloads, visible "
+                              << burst_ms << "ms after the last; single save visible after "
+                              << single_ms << "ms; " << reads << " consistent reads";
+    // 1 cpu, debounce 50ms: burst of 50 saves: 1 reloads, visible 49ms after the last;
+    // single save visible after 51ms; 703765 consistent reads
+    return 0;
+}
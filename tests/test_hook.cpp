@@ -0,0 +1,67 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+// both coroutines sleep on one thread, it takes 3s rather than 5s
+void test_sleep() {
+    uint64_t begin = mocker::GetCurrentMS();
+    {
+        mocker::IOManager iom(1, false, "sleep");
+        iom.schedule([]() {
+            sleep(2);
+            MOCKER_LOG_INFO(g_logger) << "sleep 2";
+        });
+
+        iom.schedule([]() {
+            sleep(3);
+            MOCKER_LOG_INFO(g_logger) << "sleep 3";
+        });
+    }
+    MOCKER_LOG_INFO(g_logger) << "test_sleep used " << mocker::GetCurrentMS() - begin << "ms";
+}
+
+// nobody writes to the peer, recv gives up after SO_RCVTIMEO
+void test_sock() {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    bind(listen_fd, (sockaddr *) &addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr *) &addr, &len);
+    listen(listen_fd, 8);
+
+    mocker::IOManager iom(1, false, "sock");
+    iom.schedule([addr]() {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int rt = connect(sock, (const sockaddr *) &addr, sizeof(addr));
+        MOCKER_LOG_INFO(g_logger) << "connect rt=" << rt << " errno=" << errno;
+
+        timeval tv = {0, 500 * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char buf[64];
+        uint64_t begin = mocker::GetCurrentMS();
+        rt = (int) recv(sock, buf, sizeof(buf), 0);
+        MOCKER_LOG_INFO(g_logger) << "recv rt=" << rt << " errno=" << errno
+                                  << " used " << mocker::GetCurrentMS() - begin << "ms";
+        close(sock);
+    });
+    iom.stop();
+    close(listen_fd);
+}
+
+int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::INFO);
+    test_sleep();
+    test_sock();
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+static const int ROUNDS = 10000;
+static const int PAIRS = 8;
+static const int BLOCKS = 20000;
+static const size_t BLOCK_SIZE = 4096;
+
+static double elapsed(const timeval &t1, const timeval &t2) {
+    return (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.0;
+}
+
+static int new_socket() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// PAIRS clients ping-pong ROUNDS times with an echo server on 127.0.0.1
+double bench_loopback(bool use_uring) {
+    timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    {
+        mocker::IOManager iom(2, false, use_uring ? "uring" : "epoll", use_uring);
+        MOCKER_LOG_INFO(g_logger) << "loopback engine="
+                                  << (iom.getEngine() == mocker::IOManager::IO_URING ? "io_uring" : "epoll");
+
+        int listen_fd = new_socket();
+        int on = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = 0;
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        bind(listen_fd, (sockaddr *) &addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd, (sockaddr *) &addr, &len);
+        listen(listen_fd, PAIRS);
+
+        // one acceptor, an fd takes one waiter per event
+        iom.schedule([&iom, listen_fd]() {
+            for (int i = 0; i < PAIRS; ++i) {
+                int fd = iom.accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                    MOCKER_LOG_ERROR(g_logger) << "accept fail errno=" << errno;
+                    return;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                iom.schedule([&iom, fd]() {
+                    char buf[64];
+                    for (int n = 0; n < ROUNDS; ++n) {
+                        if (iom.read(fd, buf, sizeof(buf)) <= 0) {
+                            break;
+                        }
+                        iom.write(fd, buf, sizeof(buf));
+                    }
+                    close(fd);
+                });
+            }
+        });
+
+        for (int i = 0; i < PAIRS; ++i) {
+            iom.schedule([&iom, addr]() {
+                int fd = new_socket();
+                if (iom.connect(fd, (const sockaddr *) &addr, sizeof(addr))) {
+                    MOCKER_LOG_ERROR(g_logger) << "connect fail errno=" << errno;
+                    close(fd);
+                    return;
+                }
+                char buf[64] = "ping";
+                for (int n = 0; n < ROUNDS; ++n) {
+                    iom.write(fd, buf, sizeof(buf));
+                    if (iom.read(fd, buf, sizeof(buf)) <= 0) {
+                        break;
+                    }
+                }
+                close(fd);
+            });
+        }
+        iom.stop();
+        close(listen_fd);
+    }
+    gettimeofday(&t2, nullptr);
+    return elapsed(t1, t2);
+}
+
+// write BLOCKS * BLOCK_SIZE into a tmpfs file, fsync, and read it back
+double bench_tmpfs(bool use_uring) {
+    std::string path = std::string("/dev/shm/mocker_iomanager_") + (use_uring ? "uring" : "epoll");
+    timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    {
+        mocker::IOManager iom(2, false, use_uring ? "uring" : "epoll", use_uring);
+        iom.schedule([&iom, path]() {
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            std::vector<char> buf(BLOCK_SIZE, 'm');
+            for (int i = 0; i < BLOCKS; ++i) {
+                iom.write(fd, &buf[0], BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+            }
+            iom.fsync(fd);
+            for (int i = 0; i < BLOCKS; ++i) {
+                iom.read(fd, &buf[0], BLOCK_SIZE, (off_t) i * BLOCK_SIZE);
+            }
+            close(fd);
+        });
+        iom.stop();
+    }
+    gettimeofday(&t2, nullptr);
+    unlink(path.c_str());
+    return elapsed(t1, t2);
+}
+
+int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::INFO);
+    mocker::Config::LoadFromYaml(YAML::Load("iomanager:\n  io_uring: 1"));
+
+    double uring_loopback = bench_loopback(true);
+    double epoll_loopback = bench_loopback(false);
+    double uring_tmpfs = bench_tmpfs(true);
+    double epoll_tmpfs = bench_tmpfs(false);
+
+    std::cout << "loopback " << PAIRS << "x" << ROUNDS << " ping-pong: io_uring = " << uring_loopback
+              << " epoll = " << epoll_loopback << std::endl;
+    std::cout << "tmpfs " << BLOCKS << "x" << BLOCK_SIZE << " write+read: io_uring = " << uring_tmpfs
+              << " epoll = " << epoll_tmpfs << std::endl;
+    // 1 cpu, -O0, batched submissions
+    // loopback 8x10000 ping-pong: io_uring = 2.07 ~ 2.65 epoll = 1.55 ~ 1.59
+    // tmpfs 20000x4096 write+read: io_uring = 0.80 ~ 0.88 epoll = 0.06 ~ 0.07
+    // tmpfs on the epoll engine is a plain syscall, io_uring pays one
+    // coroutine suspend and resume per request, and a single sequential
+    // stream has nothing to batch; so iomanager.io_uring stays off by default
+    return 0;
+}
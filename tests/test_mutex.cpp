@@ -0,0 +1,124 @@
+#include <sys/time.h>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+static const int s_loop = 1000000;
+
+// threads threads increase one counter s_loop times each
+template<class MutexType>
+double bench(MutexType &mutex, int threads) {
+    long count = 0;
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+
+    std::vector<mocker::Thread::ptr> thrs;
+    for (int i = 0; i < threads; ++i) {
+        thrs.emplace_back(new mocker::Thread([&mutex, &count]() {
+            for (int j = 0; j < s_loop; ++j) {
+                typename MutexType::Lock lock(mutex);
+                ++count;
+            }
+        }, "mutex_" + std::to_string(i)));
+    }
+    for (auto &thr : thrs) {
+        thr->join();
+    }
+
+    gettimeofday(&t2, nullptr);
+    MOCKER_ASSERT(count == (long) threads * s_loop);
+    return (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.0;
+}
+
+static const int s_read_loop = 200000;
+
+// read-mostly like ConfigVar::getValue, one write every 10000 reads
+template<class RWMutexType>
+double bench_read(RWMutexType &mutex, int threads) {
+    std::map<std::string, int> data{{"system.port", 8080}, {"system.value", 10}};
+    long sum = 0;
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+
+    std::vector<mocker::Thread::ptr> thrs;
+    for (int i = 0; i < threads; ++i) {
+        thrs.emplace_back(new mocker::Thread([&mutex, &data, &sum, i]() {
+            long local = 0;
+            for (int j = 0; j < s_read_loop; ++j) {
+                if (i == 0 && j % 10000 == 0) {
+                    typename RWMutexType::WriteLock lock(mutex);
+                    ++data["system.value"];
+                } else {
+                    typename RWMutexType::ReadLock lock(mutex);
+                    local += data.find("system.port")->second;
+                }
+            }
+            typename RWMutexType::WriteLock lock(mutex);
+            sum += local;
+        }, "rw_" + std::to_string(i)));
+    }
+    for (auto &thr : thrs) {
+        thr->join();
+    }
+
+    gettimeofday(&t2, nullptr);
+    MOCKER_ASSERT(sum == 8080l * (threads * s_read_loop - s_read_loop / 10000));
+    return (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int threads : {1, 4}) {
+        mocker::Mutex mutex;
+        mocker::Spinlock spinlock;
+        mocker::CASLock caslock;
+        mocker::AdaptiveMutex adaptive;
+        std::cout << threads << " threads x " << s_loop << ": "
+                  << "Mutex = " << bench(mutex, threads)
+                  << " Spinlock = " << bench(spinlock, threads)
+                  << " CASLock = " << bench(caslock, threads)
+                  << " AdaptiveMutex = " << bench(adaptive, threads) << std::endl;
+
+        mocker::AdaptiveMutex::Stats stats = adaptive.getStats();
+        MOCKER_LOG_INFO(g_logger) << "AdaptiveMutex acquisitions=" << stats.acquisitions
+                                  << " contended=" << stats.contended
+                                  << " spin_acquired=" << stats.spinAcquired
+                                  << " futex_waits=" << stats.futexWaits
+                                  << " hold_ns=" << stats.holdNs
+                                  << " spin_count=" << adaptive.getSpinCount();
+    }
+
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        mocker::RWMutex rwmutex;
+        mocker::DistributedRWMutex distributed;
+        std::cout << threads << " threads x " << s_read_loop << " reads: "
+                  << "RWMutex = " << bench_read(rwmutex, threads)
+                  << " DistributedRWMutex = " << bench_read(distributed, threads) << std::endl;
+    }
+
+    // with MOCKER_LOCK_PROFILE the hot lock leads the report
+    mocker::Mutex hot("test.hot");
+    mocker::Spinlock cold("test.cold");
+    bench(hot, 4);
+    bench(cold, 1);
+    std::cout << mocker::LockProfile::Report();
+    // 1 cpu, -O0, AdaptiveMutex never spins on one cpu
+    // 1 threads x 1000000: Mutex = 0.0327 Spinlock = 0.0199 CASLock = 0.0315 AdaptiveMutex = 0.0424
+    // 4 threads x 1000000: Mutex = 0.1375 Spinlock = 0.1898 CASLock = 0.3081 AdaptiveMutex = 0.1385
+    // with MOCKER_MUTEX_STATS, 4 threads: contended=208 futex_waits=337
+    // MOCKER_LOCK_PROFILE=ON, 1 cpu, a holder preempted by the tick makes the long waits
+    // name        acquire  contended  wait_ms  max_wait_us  hold_ms  wait histogram (4^i ns)
+    // test.hot    4000000        142   672.13      16003.3  209.964  0 0 0 0 0 0 11 1 0 0 100 30
+    // test.cold   1000000          0        0            0   53.588
+    // 1 cpu: one slot, so this only measures a single shared counter; threads
+    // never read at the same time, the line of RWMutex never bounces and the
+    // slots only add the writer's scan. Config keeps RWMutex until a multi-core
+    // run shows the slots pay off
+    // 1 threads x 200000 reads: RWMutex = 0.0306 DistributedRWMutex = 0.0447
+    // 8 threads x 200000 reads: RWMutex = 0.2378 DistributedRWMutex = 0.3595
+    // 64 threads x 200000 reads: RWMutex = 1.8867 DistributedRWMutex = 2.6536
+    return 0;
+}
@@ -2,6 +2,12 @@
 // Created by ChaosChen on 2021/8/2.
 //
 
+#include <unistd.h>
+#include <sys/time.h>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
 #include <mocker/mocker.h>
 
 mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
@@ -15,7 +21,290 @@ void test_coroutine() {
         mocker::Scheduler::GetCurrent()->schedule(&test_coroutine, mocker::GetThreadId());
 }
 
+static std::atomic<int> s_done = {0};
+
+static void empty_task() {
+    ++s_done;
+}
+
+static double elapsed(const struct timeval &t1, const struct timeval &t2) {
+    return (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.0;
+}
+
+// one producer fans out n tasks to 4 workers, per task or in one batch
+void test_fan_out(int n, bool batch) {
+    struct timeval t1, t2, t3;
+    s_done = 0;
+    mocker::IOManager iom(4, false, "fan_out", false);
+    sleep(1);
+
+    gettimeofday(&t1, nullptr);
+    if (batch) {
+        mocker::Scheduler::Batch tasks;
+        for (int i = 0; i < n; ++i) {
+            tasks.add(&empty_task);
+        }
+        iom.schedule(tasks);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            iom.schedule(&empty_task);
+        }
+    }
+    gettimeofday(&t2, nullptr);
+    while (s_done < n) {
+        sched_yield();
+    }
+    gettimeofday(&t3, nullptr);
+
+    iom.stop();
+    std::cout << "fan out " << n << " tasks with " << (batch ? "batch" : "schedule")
+              << ": submit = " << elapsed(t1, t2) << " total = " << elapsed(t1, t3) << std::endl;
+}
+
+struct RequestContext {
+    static std::atomic<int> s_destroyed;
+    int id = -1;
+
+    ~RequestContext() {
+        ++s_destroyed;
+    }
+};
+
+std::atomic<int> RequestContext::s_destroyed{0};
+
+static mocker::CoroutineLocal<RequestContext> s_request;
+
+// each coroutine keeps its own context while it hops between workers
+void test_coroutine_local() {
+    const int coroutines = 100;
+    std::atomic<int> migrated{0};
+    s_request->id = 0;
+    {
+        mocker::Scheduler sc(4, false, "local");
+        sc.start();
+        for (int i = 1; i <= coroutines; ++i) {
+            sc.schedule([&migrated, i]() {
+                MOCKER_ASSERT(!s_request.has());
+                s_request->id = i;
+                pid_t thread = mocker::GetThreadId();
+                for (int j = 0; j < 100; ++j) {
+                    mocker::Coroutine::Yield();
+                    MOCKER_ASSERT(s_request->id == i);
+                }
+                if (thread != mocker::GetThreadId()) {
+                    ++migrated;
+                }
+            });
+        }
+        sc.stop();
+    }
+    // outside of coroutines the thread has its own
+    MOCKER_ASSERT(s_request->id == 0);
+    MOCKER_ASSERT(RequestContext::s_destroyed == coroutines);
+    std::cout << coroutines << " coroutines kept their context, " << migrated
+              << " of them moved to another thread" << std::endl;
+}
+
+// one worker busy while the queues fill, then they drain class by class
+void test_priority() {
+    std::vector<std::pair<int, int>> order;
+    {
+        mocker::Scheduler sc(1, false, "priority");
+        sc.setMaxWait(0);
+        sc.start();
+        sc.schedule([]() {
+            usleep(20 * 1000);
+        });
+        uint64_t now = mocker::GetCurrentMS();
+        for (int i = 0; i < 100; ++i) {
+            sc.schedule([&order, i]() {
+                order.emplace_back(mocker::Scheduler::BACKGROUND, i);
+            }, mocker::Scheduler::BACKGROUND);
+            sc.schedule([&order, i]() {
+                order.emplace_back(mocker::Scheduler::NORMAL, i);
+            });
+            sc.schedule([&order, i]() {
+                order.emplace_back(mocker::Scheduler::HIGH, i);
+            }, mocker::Scheduler::HIGH);
+        }
+        // the later the deadline is scheduled, the sooner it is due
+        for (int i = 0; i < 10; ++i) {
+            sc.scheduleDeadline([&order, i]() {
+                order.emplace_back(mocker::Scheduler::DEADLINE, i);
+            }, now + 1000 - i);
+        }
+        usleep(100 * 1000);
+        mocker::Scheduler::QueueStats stats = sc.getQueueStats(mocker::Scheduler::BACKGROUND);
+        MOCKER_ASSERT(stats.maxDepth == 100 && stats.runs == 100 && stats.depth == 0);
+        sc.stop();
+    }
+    MOCKER_ASSERT(order.size() == 310);
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i < 10) {
+            MOCKER_ASSERT(order[i].first == mocker::Scheduler::DEADLINE && order[i].second == 9 - (int) i);
+        } else {
+            MOCKER_ASSERT(order[i].first == (int) (i - 10) / 100 + 1 && order[i].second == (int) (i - 10) % 100);
+        }
+    }
+}
+
+// two chains of HIGH tasks keep the worker busy, a BACKGROUND task still gets through
+uint64_t test_aging(uint64_t max_wait_ms) {
+    mocker::Scheduler sc(1, false, "aging");
+    sc.setMaxWait(max_wait_ms);
+    sc.start();
+    std::atomic<bool> stop{false};
+    std::function<void()> chain = [&sc, &stop, &chain]() {
+        uint64_t begin = mocker::GetCurrentUS();
+        while (mocker::GetCurrentUS() - begin < 100);
+        if (!stop) {
+            sc.schedule(chain, mocker::Scheduler::HIGH);
+        }
+    };
+    sc.schedule(chain, mocker::Scheduler::HIGH);
+    sc.schedule(chain, mocker::Scheduler::HIGH);
+
+    std::atomic<uint64_t> ran{0};
+    uint64_t begin = mocker::GetCurrentMS();
+    sc.schedule([&ran]() {
+        ran = mocker::GetCurrentMS();
+    }, mocker::Scheduler::BACKGROUND);
+    while (!ran && mocker::GetCurrentMS() - begin < 500) {
+        usleep(1000);
+    }
+    stop = true;
+    sc.stop();
+    return ran ? ran - begin : 500;
+}
+
+// tasks that yield once, counted on both sides of the yield
+void test_metrics() {
+    mocker::Scheduler sc(2, false, "metrics");
+    sc.setMetricsDump(20);
+    sc.setMetricsTiming(true);
+    sc.start();
+    std::atomic<int> done{0};
+    for (int i = 0; i < 1000; ++i) {
+        sc.schedule([&done]() {
+            mocker::Coroutine::Yield();
+            ++done;
+        });
+    }
+    while (done < 1000) {
+        usleep(1000);
+    }
+    usleep(50 * 1000);
+    mocker::Scheduler::Metrics metrics = sc.getMetrics();
+    sc.stop();
+    std::cout << metrics.toString() << std::endl;
+    MOCKER_ASSERT(metrics.workers.size() == 2);
+    MOCKER_ASSERT(metrics.total.tasks == 1000 && metrics.total.run.count() == 2000);
+    MOCKER_ASSERT(metrics.total.switches >= 2000);
+    MOCKER_ASSERT(metrics.total.wait.count() == 2000);
+    MOCKER_ASSERT(metrics.queues[mocker::Scheduler::NORMAL].runs == 2000);
+
+    // a restart counts its own workers only
+    sc.start();
+    sc.stop();
+    MOCKER_ASSERT(sc.getMetrics().workers.size() == 2);
+}
+
+// per switch cost on one worker: two coroutines yielding to each other,
+// then a chain of callbacks each scheduling the next
+void bench_ping(int n) {
+    mocker::Scheduler sc(1, false, "ping");
+    sc.start();
+    mocker::Semaphore done;
+    struct timeval t1, t2, t3;
+
+    gettimeofday(&t1, nullptr);
+    std::atomic<int> finished{0};
+    for (int i = 0; i < 2; ++i) {
+        sc.schedule([n, &finished, &done]() {
+            for (int j = 0; j < n; ++j) {
+                mocker::Coroutine::Yield();
+            }
+            if (++finished == 2) {
+                done.notify();
+            }
+        });
+    }
+    done.wait();
+    gettimeofday(&t2, nullptr);
+
+    int left = n;
+    std::function<void()> next = [&sc, &left, &next, &done]() {
+        if (--left > 0) {
+            sc.schedule(next);
+        } else {
+            done.notify();
+        }
+    };
+    sc.schedule(next);
+    done.wait();
+    gettimeofday(&t3, nullptr);
+    sc.stop();
+
+    std::cout << "ping " << 2 * n << " yields: " << elapsed(t1, t2) * 1e9 / (2 * n) << "ns each, "
+              << n << " chained callbacks: " << elapsed(t2, t3) * 1e9 / n << "ns each" << std::endl;
+}
+
+// time until start() returns with every worker running, 5 rounds averaged
+double test_startup(size_t threads) {
+    const int rounds = 5;
+    double total = 0;
+    for (int i = 0; i < rounds; ++i) {
+        mocker::Scheduler sc(threads, false, "startup");
+        struct timeval t1, t2;
+        gettimeofday(&t1, nullptr);
+        sc.start();
+        gettimeofday(&t2, nullptr);
+        total += elapsed(t1, t2);
+        sc.stop();
+    }
+    return total / rounds;
+}
+
 int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::WARN);
+    bench_ping(100000);
+    // 1 cpu, -O0, before: taken tasks copied out of the queue, yielded ones scheduled anew
+    // ping 200000 yields: 2247.57ns each, 100000 chained callbacks: 4070.34ns each
+    // after: queue nodes moved and reused, callbacks moved into the coroutine
+    // ping 200000 yields: 1498.79ns each, 100000 chained callbacks: 3637.47ns each
+    test_fan_out(10000, false);
+    test_fan_out(10000, true);
+    // 1 cpu, -O0, the workers can not run while the producer submits
+    // fan out 10000 tasks with schedule: submit = 0.0073 total = 0.0291
+    // fan out 10000 tasks with batch: submit = 0.0038 total = 0.0301
+    test_coroutine_local();
+    test_priority();
+    test_metrics();
+    std::cout << "metrics timing on: ";
+    mocker::Config::LoadFromYaml(YAML::Load("scheduler:\n  metrics_timing: 1"));
+    test_fan_out(10000, false);
+    mocker::Config::LoadFromYaml(YAML::Load("scheduler:\n  metrics_timing: 0"));
+    std::cout << "metrics timing off: ";
+    test_fan_out(10000, false);
+    // 1 cpu, -O0, four runs on a busy box, the two clock reads a task drown in the noise:
+    // metrics timing on: total = 0.043 ~ 0.054, metrics timing off: total = 0.041 ~ 0.060
+    std::cout << "background task behind a stream of high ones ran after: max wait 10ms = "
+              << test_aging(10) << "ms, aging off = " << test_aging(0) << "ms (gave up at 500)" << std::endl;
+    // 1 cpu, -O0: max wait 10ms = 10ms, aging off = 500ms (gave up at 500)
+    std::cout << "start 64 workers: " << test_startup(64) * 1000 << "ms" << std::endl;
+    mocker::Config::LoadFromYaml(YAML::Load("scheduler:\n  thread:\n    stack_size: 262144"));
+    std::cout << "start 64 workers, 256k stacks: " << test_startup(64) * 1000 << "ms" << std::endl;
+    mocker::Config::LoadFromYaml(YAML::Load("scheduler:\n  thread:\n    prefault_stack: 1"));
+    std::cout << "start 64 workers, 256k prefaulted stacks: " << test_startup(64) * 1000 << "ms" << std::endl;
+    mocker::Config::LoadFromYaml(YAML::Load("scheduler:\n  thread:\n    stack_size: 0\n    prefault_stack: 0"));
+    // 1 cpu, -O0: a new thread runs at once, so waiting for each start in turn
+    // cost little more than waiting for all of them; several cpus overlap the wakeups
+    // before, a handshake per thread: start 64 workers: 1.9662ms
+    // after: start 64 workers: 1.878ms
+    // start 64 workers, 256k stacks: 1.6678ms
+    // start 64 workers, 256k prefaulted stacks: 7.902ms, touching every page is paid up front
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::DEBUG);
+
     mocker::Scheduler sc(3, false, "test");
     sc.start();
     sleep(2);
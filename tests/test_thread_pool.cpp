@@ -0,0 +1,136 @@
+#include <unistd.h>
+#include <sys/time.h>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+static const int s_tasks = 10000;
+
+long work(long i) {
+    long sum = 0;
+    for (long j = 0; j < 100; ++j) {
+        sum += i * j;
+    }
+    return sum;
+}
+
+double elapsed_ms(const struct timeval &t1, const struct timeval &t2) {
+    return (t2.tv_sec - t1.tv_sec) * 1000.0 + (t2.tv_usec - t1.tv_usec) / 1000.0;
+}
+
+// s_tasks small tasks, each on a thread of its own
+double bench_spawn() {
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    long sum = 0;
+    for (int i = 0; i < s_tasks; ++i) {
+        long result = 0;
+        mocker::Thread thr([&result, i]() {
+            result = work(i);
+        }, "spawn");
+        thr.join();
+        sum += result;
+    }
+    gettimeofday(&t2, nullptr);
+    MOCKER_ASSERT(sum == work(1) * ((long) s_tasks * (s_tasks - 1) / 2));
+    return elapsed_ms(t1, t2);
+}
+
+// the same tasks submitted to a pool
+double bench_pool(mocker::ThreadPool &pool) {
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    std::vector<mocker::Future<long>> futures;
+    for (int i = 0; i < s_tasks; ++i) {
+        futures.push_back(pool.submit([i]() {
+            return work(i);
+        }));
+    }
+    long sum = 0;
+    for (auto &future : futures) {
+        sum += future.get();
+    }
+    gettimeofday(&t2, nullptr);
+    MOCKER_ASSERT(sum == work(1) * ((long) s_tasks * (s_tasks - 1) / 2));
+    return elapsed_ms(t1, t2);
+}
+
+void test_parallel(mocker::ThreadPool &pool) {
+    const size_t n = 1000000;
+    std::vector<long> data(n);
+    pool.parallelFor(0, n, [&data](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            data[i] = (long) i;
+        }
+    }, 10000);
+
+    long sum = pool.parallelReduce<long>(0, n, 0, [&data](size_t begin, size_t end) {
+        return std::accumulate(data.begin() + begin, data.begin() + end, 0l);
+    }, [](const long &a, const long &b) {
+        return a + b;
+    }, 10000);
+    MOCKER_ASSERT(sum == (long) n * (n - 1) / 2);
+
+    // nested in a task of the same pool, the task helps with its own chunks
+    long nested = pool.submit([&pool]() {
+        return pool.parallelReduce<long>(0, 1000, 0, [](size_t begin, size_t end) {
+            return (long) (end - begin);
+        }, [](const long &a, const long &b) {
+            return a + b;
+        });
+    }).get();
+    MOCKER_ASSERT(nested == 1000);
+
+    try {
+        pool.submit([]() -> int {
+            throw std::runtime_error("task failed");
+        }).get();
+        MOCKER_ASSERT(false);
+    } catch (std::runtime_error &e) {
+        MOCKER_LOG_INFO(g_logger) << "rethrown: " << e.what();
+    }
+
+    auto name = pool.submit([]() {
+        return mocker::Thread::GetCurrentName();
+    }).get();
+    MOCKER_ASSERT(name.compare(0, pool.getName().size(), pool.getName()) == 0);
+}
+
+// grows while every thread is busy, shrinks after idle_ms
+void test_elastic() {
+    mocker::ThreadPool pool(1, 4, 16, "elastic", 50);
+    std::vector<mocker::Future<void>> futures;
+    for (int i = 0; i < 8; ++i) {
+        futures.push_back(pool.submit([]() {
+            usleep(20 * 1000);
+        }));
+    }
+    size_t grown = pool.getThreadCount();
+    for (auto &future : futures) {
+        future.get();
+    }
+    usleep(300 * 1000);
+    MOCKER_LOG_INFO(g_logger) << "elastic pool grew to " << grown << " threads, shrank to "
+                              << pool.getThreadCount();
+    MOCKER_ASSERT(grown == 4 && pool.getThreadCount() == 1);
+}
+
+int main(int argc, char *argv[]) {
+    {
+        mocker::ThreadPool pool(4, 0, 1024, "pool");
+        test_parallel(pool);
+        double spawn_ms = bench_spawn();
+        double pool_ms = bench_pool(pool);
+        std::cout << s_tasks << " tasks: thread per task = " << spawn_ms << "ms pool of 4 = "
+                  << pool_ms << "ms" << std::endl;
+    }
+    test_elastic();
+    // 1 cpu, -O0, a thread per task pays pthread_create and the start handshake every time
+    // 10000 tasks: thread per task = 122.202ms pool of 4 = 27.902ms
+    return 0;
+}
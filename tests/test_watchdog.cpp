@@ -0,0 +1,87 @@
+#include <unistd.h>
+#include <sys/time.h>
+#include <iostream>
+
+#include <mocker/mocker.h>
+
+mocker::Logger::ptr g_logger = MOCKER_LOG_ROOT();
+
+double elapsed_ms(const struct timeval &t1, const struct timeval &t2) {
+    return (t2.tv_sec - t1.tv_sec) * 1000.0 + (t2.tv_usec - t1.tv_usec) / 1000.0;
+}
+
+// n coroutines created, swapped out once and destroyed
+double bench_coroutines(int n) {
+    struct timeval t1, t2;
+    gettimeofday(&t1, nullptr);
+    mocker::Coroutine::GetCurrent();
+    for (int i = 0; i < n; ++i) {
+        mocker::Coroutine::ptr cort(new mocker::Coroutine([]() {
+            mocker::Coroutine::GetCurrent()->back();
+        }, 64 * 1024, true));
+        cort->call();
+        cort->call();
+    }
+    gettimeofday(&t2, nullptr);
+    return elapsed_ms(t1, t2);
+}
+
+// one coroutine spins without yielding, one sleeps through the hooks
+void test_watchdog() {
+    std::atomic<uint64_t> stuck_id{0};
+    uint64_t spin_id = 0;
+    uint64_t sleep_id = 0;
+
+    mocker::CoroutineWatchdog watchdog(50, 10);
+    watchdog.setHandler([&stuck_id](const mocker::CoroutineRegistry::Info &info) {
+        MOCKER_LOG_INFO(g_logger) << "stuck: id=" << info.id << " " << info.stateUs / 1000 << "ms on "
+                                  << info.scheduler << "\n" << info.created;
+        stuck_id = info.id;
+    });
+    watchdog.start();
+
+    mocker::IOManager iom(2, false, "watched");
+    iom.schedule([&spin_id]() {
+        spin_id = mocker::Coroutine::GetCoroutineId();
+        uint64_t begin = mocker::GetCurrentMS();
+        while (mocker::GetCurrentMS() - begin < 200);
+    });
+    iom.schedule([&sleep_id]() {
+        sleep_id = mocker::Coroutine::GetCoroutineId();
+        usleep(300 * 1000);
+    });
+    usleep(150 * 1000);
+
+    std::string dump = mocker::CoroutineRegistry::DumpToString();
+    std::cout << dump;
+    bool sleeping_seen = false;
+    for (auto &info : mocker::CoroutineRegistry::Dump()) {
+        if (info.id == sleep_id) {
+            MOCKER_ASSERT(info.state == mocker::Coroutine::HOLD && info.scheduler == "watched");
+            MOCKER_ASSERT(!info.created.empty() && !info.suspended.empty());
+            sleeping_seen = true;
+        }
+    }
+    MOCKER_ASSERT(sleeping_seen);
+
+    iom.stop();
+    watchdog.stop();
+    // the spin is reported once, the idle coroutines blocked in epoll_wait never
+    MOCKER_ASSERT(stuck_id == spin_id && watchdog.getReportCount() == 1);
+}
+
+int main(int argc, char *argv[]) {
+    MOCKER_LOG_SYSTEM()->setLevel(mocker::LogLevel::WARN);
+    const int n = 100000;
+    double plain_ms = bench_coroutines(n);
+    mocker::Config::LoadFromYaml(YAML::Load("coroutine:\n  debug_backtrace: 1"));
+    double debug_ms = bench_coroutines(n);
+    std::cout << n << " coroutines created, switched 4 times and freed: " << plain_ms
+              << "ms, with backtraces " << debug_ms << "ms" << std::endl;
+
+    test_watchdog();
+    // 1 cpu, -O0, the registry lock and the state stamps, before and after:
+    // 100000 coroutines created, switched 4 times and freed: 401.71ms
+    // 100000 coroutines created, switched 4 times and freed: 447.544ms, with backtraces 590.942ms
+    return 0;
+}